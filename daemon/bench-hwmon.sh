@@ -0,0 +1,141 @@
+#!/bin/sh
+# Generate a synthetic hwmon tree for "make bench": the devices the daemon
+# drives and reads (uniwill_ibg10_fanctl, uniwill, k10temp, amdgpu, nvme),
+# unrelated filler devices it has to skip, and a config with sensor rules,
+# [cpu]/[gpu] sections and profiles so reloads parse something real.
+#
+# Usage: bench-hwmon.sh DIR [FILLER]
+#
+# DIR is replaced if it holds a tree made by this script. FILLER (default
+# 24) unrelated devices are added after the 6 real ones.
+
+set -e
+
+dir=${1:?usage: $0 DIR [FILLER]}
+filler=${2:-24}
+n=0
+
+if [ -e "$dir" ]; then
+    if [ ! -e "$dir/.fanctl-bench" ]; then
+        echo "$dir exists and wasn't made by $0, not touching it" >&2
+        exit 1
+    fi
+    rm -rf "$dir"
+fi
+mkdir -p "$dir"
+touch "$dir/.fanctl-bench"
+
+# dev NAME: start the next hwmonN, with the attributes every device has
+dev() {
+    d=$dir/hwmon$n
+    n=$((n + 1))
+    mkdir "$d"
+    echo "$1" > "$d/name"
+    echo "DEVTYPE=hwmon" > "$d/uevent"
+    echo 1000 > "$d/update_interval"
+}
+
+# temp CH MDEG [LABEL]
+temp() {
+    echo "$2" > "$d/temp$1_input"
+    echo 105000 > "$d/temp$1_crit"
+    [ -z "$3" ] || echo "$3" > "$d/temp$1_label"
+}
+
+# volts COUNT: inN_input entries, the bulk of many real devices
+volts() {
+    v=0
+    while [ $v -lt "$1" ]; do
+        echo 1200 > "$d/in${v}_input"
+        v=$((v + 1))
+    done
+}
+
+dev uniwill_ibg10_fanctl
+temp 1 64000
+echo 90000 > "$d/temp1_max"
+for ch in 1 2; do
+    echo 64 > "$d/pwm$ch"
+    echo 2 > "$d/pwm${ch}_enable"
+    echo 2100 > "$d/fan${ch}_input"
+done
+echo 64 > "$d/pwm_all"
+
+dev uniwill
+temp 1 63000 CPU
+for ch in 1 2; do
+    echo 64 > "$d/pwm$ch"
+    chmod 0444 "$d/pwm$ch"
+    echo 2100 > "$d/fan${ch}_input"
+done
+
+dev k10temp
+temp 1 66000 Tctl
+temp 3 61000 Tccd1
+temp 4 59000 Tccd2
+
+dev amdgpu
+temp 1 52000 edge
+volts 2
+echo 15000000 > "$d/power1_average"
+
+for i in 0 1; do
+    dev nvme
+    temp 1 41000 Composite
+    temp 2 43000 "Sensor 1"
+    temp 3 39000 "Sensor 2"
+done
+
+i=0
+while [ $i -lt "$filler" ]; do
+    case $((i % 4)) in
+    0) dev acpitz; temp 1 50000 ;;
+    1) dev "BAT$i"; volts 1; echo 1500000 > "$d/curr1_input" ;;
+    2) dev iwlwifi_1; temp 1 45000 ;;
+    3) dev spd5118; temp 1 40000; volts 8 ;;
+    esac
+    i=$((i + 1))
+done
+
+cat > "$dir/bench.conf" <<'EOF'
+point = 55 32
+point = 65 64
+point = 75 128
+point = 85 192
+point = 92 255
+hysteresis = 6
+min_speed = 32
+coupling = 30
+filter = ema
+filter_alpha = 0.3
+predict_ahead = 10
+feedforward = 40
+sensor = k10temp 100
+sensor = k10temp/Tctl 100 -2
+sensor = nvme 80
+sensor = nvme/Composite 90 -5
+sensor = uniwill 100
+sensor = amdgpu/edge 100 3
+
+[cpu]
+point = 55 32
+point = 90 255
+
+[gpu]
+controller = pid
+setpoint = 70
+
+[profile quiet]
+point = 60 32
+point = 95 200
+
+[profile balanced]
+slew_up = 20
+slew_down = 5
+
+[profile performance]
+point = 45 64
+point = 80 255
+EOF
+
+echo "$dir: $n devices"
@@ -10,7 +10,9 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,12 +20,30 @@
 #include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-
-#define HWMON_BASE "/sys/class/hwmon"
-
-/* Temperature thresholds (C) */
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#define HWMON_BASE "/sys/class/hwmon"     /* default hwmon root */
+#define HWMON_ROOT_ENV "UNIWILL_IBG10_FANCTL_HWMON_ROOT"
+#define PSI_CPU_PATH "/proc/pressure/cpu"
+#define PLATFORM_PROFILE_PATH "/sys/firmware/acpi/platform_profile"
+#define RUN_DIR "/run/uniwill-ibg10-fanctl"
+#define METRICS_PATH RUN_DIR "/metrics"
+#define STATUS_SOCKET RUN_DIR "/status.sock"
+#define PROC_STAT_PATH "/proc/stat"
+#define CONFIG_PATH "/etc/uniwill-ibg10-fanctl.conf"
+
+/* Built-in curve, used when there is no config file. Temperature thresholds (C) */
 #define TEMP_SILENT     62
 #define TEMP_LOW        70
 #define TEMP_MED        78
@@ -40,355 +60,3235 @@
 #define SPEED_HIGH      192  /* 75% */
 #define SPEED_MAX       255  /* 100% */
 
-/* Timing */
-#define POLL_INTERVAL   1       /* Seconds between updates */
+#define CURVE_MAX_POINTS 64
+#define CURVE_LUT_SIZE  256     /* one entry per integer C */
+
+#define HWMON_INIT      32      /* initial index capacity, grown as needed */
+#define BENCH_RUNS      100     /* --bench: discovery passes and config reloads timed */
+
+/* Sensor set */
+#define SENSOR_MAX      32
+#define SENSOR_RULES_MAX 16
+#define PROFILE_MAX 8
+
+/* Sensor filter */
+#define FILTER_RING     16      /* Samples kept per source, power of two */
+#define FILTER_ALPHA    0.3     /* EMA weight of a new sample */
+#define FILTER_WINDOW   5       /* Median-of-N */
+#define FILTER_ATTACK   0.2     /* Asymmetric EMA weight while rising */
+#define FILTER_RELEASE  0.5     /* ... and while falling */
+
+/* Predictive ramp */
+#define PREDICT_WINDOW_MS 5000  /* Samples used for the slope */
+#define PREDICT_SLOPE   0.5     /* C/s above which the fans pre-ramp */
+#define PREDICT_MAX_AHEAD 30    /* s */
+
+/* Load feed-forward */
+#define FEEDFORWARD_THRESHOLD 30    /* % CPU pressure/utilization where the boost starts */
+#define FEEDFORWARD_SUSTAIN_MS 2000 /* Load must stay above the threshold this long */
+
+/* PID controller defaults */
+#define PID_SETPOINT    75      /* C */
+#define PID_KP          8.0     /* pwm per C of error */
+#define PID_KI          0.5     /* pwm per C*s */
+#define PID_KD          0.0     /* pwm per C/s */
+#define PID_MIN_STEP    4       /* Smallest PWM change worth an EC write */
+
+/* Timing (ms). The loop ticks faster while heating up and backs off when idle. */
+#define TICK_FAST       250     /* Temperature rising or near a curve knee */
+#define TICK_NORMAL     1000
+#define TICK_IDLE_MAX   8000    /* Upper bound of the backoff while idle at the lowest speed */
+#define TICK_GRID       250     /* Deadlines are aligned to this grid so wakeups coalesce */
+#define KNEE_MARGIN     2       /* C around a curve knee that counts as near */
+#define TIMER_SLACK_PCT 10      /* Timer slack as percentage of the tick interval */
+#define READBACK_INTERVAL 10    /* Seconds between PWM readbacks to detect EC overrides */
+#define READBACK_TOLERANCE 4    /* PWM difference accepted from 0-255 <-> 0-200 rounding */
+#define RESUME_MIN_SLEEP 1000   /* ms CLOCK_BOOTTIME must outrun CLOCK_MONOTONIC to count as a resume */
+
+/* --replay report thresholds */
+#define REPLAY_HOT_TEMP 85          /* C */
+#define REPLAY_LOUD_PWM SPEED_HIGH
+
+struct fan_state {
+    int current;        /* Current speed (0-255) */
+    int prev_target;    /* Previous target for trend */
+    int commanded;      /* Last value written to the sink, -1 if unknown */
+    int prev_temp;      /* Temperature seen on the previous tick, -1 if none */
+    long long last_readback; /* ms, CLOCK_MONOTONIC */
+    long long last_control;  /* ms of the previous controller run, 0 if none */
+    double integral;    /* PID integral term (pwm) */
+    int prev_error;     /* PID error on the previous run (C) */
+    int boost;          /* feed-forward included in current */
+};
+
+#define FAN_STATE_INIT { .current = 0, .prev_target = -1, .commanded = -1, .prev_temp = -1, \
+                         .last_readback = 0, .last_control = 0, .integral = 0, .prev_error = 0, .boost = 0 }
+
+struct curve_point {
+    int temp;           /* C */
+    int pwm;            /* 0-255 */
+};
+
+/*
+ * Fan curve and controller settings as loaded from the config. The curve
+ * is compiled into lookup tables so a tick costs two array reads instead
+ * of interpolating twice.
+ */
+struct fan_curve {
+    struct curve_point points[CURVE_MAX_POINTS];
+    int npoints;
+    int hysteresis;     /* C cooler before stepping down */
+    int min_speed;      /* floor for every table entry and the PID output */
+    int controller;     /* index into controllers[] */
+    int setpoint;       /* C the PID controller aims for */
+    double kp, ki, kd;
+    int slew_up;        /* max PWM increase per second, 0 = unlimited */
+    int slew_down;      /* max PWM decrease per second, 0 = unlimited */
+    unsigned char up[CURVE_LUT_SIZE];   /* speed at temp */
+    unsigned char down[CURVE_LUT_SIZE]; /* speed at temp + hysteresis */
+};
+
+enum filter_kind {
+    FILTER_NONE,
+    FILTER_EMA,
+    FILTER_MEDIAN,
+    FILTER_ASYMMETRIC,
+};
+
+struct filter_config {
+    enum filter_kind kind;
+    double alpha;       /* EMA */
+    int window;         /* median, 1..FILTER_RING */
+    double attack;      /* asymmetric */
+    double release;
+};
+
+/* hwmon_dev.flags */
+#define HWMON_HAS_PWM_ALL   (1u << 0)
+#define HWMON_HAS_TEMP1_MAX (1u << 1)
+
+/*
+ * What one hwmon device offers, collected in a single walk of its
+ * directory. Bit N of a mask stands for channel N.
+ */
+struct hwmon_dev {
+    int num;            /* N of hwmonN */
+    char name[32];
+    uint32_t temp_input;
+    uint32_t temp_label;
+    uint32_t pwm;
+    uint32_t pwm_writable;
+    uint32_t pwm_enable;
+    uint32_t fan_input;
+    unsigned int flags; /* HWMON_HAS_* */
+};
+
+enum sensor_group {
+    GROUP_CPU,
+    GROUP_GPU,
+};
+
+/* One tempN_input, read every tick. Kept small so the set stays contiguous */
+struct sensor {
+    int fd;             /* -1 if the attribute couldn't be (re)opened */
+    int offset;         /* millidegrees added after weighting */
+    short weight;       /* %, 0 = not read */
+    short hwmon;        /* N of hwmonN */
+    int raw;            /* last reading as read, METRICS_NONE if none */
+    int value;          /* ... and weighted */
+    unsigned char channel; /* N of tempN_input */
+    unsigned char group;   /* enum sensor_group */
+};
+
+/* Cold companion of a struct sensor, for matching rules and display */
+struct sensor_info {
+    char name[32];      /* hwmon device name */
+    char label[32];     /* tempN_label, or "tempN" */
+};
+
+/* "sensor = name[/label] weight [offset]" from the config */
+struct sensor_rule {
+    char name[32];
+    char label[32];     /* "" matches every sensor of the device */
+    int weight;
+    int offset;         /* millidegrees */
+};
+
+/* Recent raw samples of one temperature source, in millidegrees */
+struct temp_filter {
+    int samples[FILTER_RING];
+    long long stamps[FILTER_RING]; /* ms, CLOCK_MONOTONIC */
+    unsigned int head;  /* slot of the next sample */
+    unsigned int count; /* valid samples, up to FILTER_RING */
+    double value;       /* filtered temperature (EMA state) */
+};
+
+/* The curves for one power profile: unified mode, and fan 1/fan 2 with --split */
+struct curve_set {
+    struct fan_curve unified;
+    struct fan_curve fan[2];
+};
+
+/* A [profile NAME] section, used while platform_profile reads NAME */
+struct curve_profile {
+    char name[32];
+    struct curve_set set;
+};
+
+/*
+ * Everything loaded from the config file. The top level curve drives both
+ * fans in unified mode; with --split, [cpu] and [gpu] sections (inheriting
+ * from the top level) drive fan 1 and fan 2. [profile NAME] sections
+ * (inheriting from all of those) replace them while that platform profile
+ * is active.
+ */
+struct fan_config {
+    struct curve_set base;
+    struct curve_profile profiles[PROFILE_MAX];
+    int nprofiles;
+    int coupling;       /* % of the other fan's extra heat added in split mode */
+    struct filter_config filter;
+    int predict_ahead;  /* s to look ahead while heating fast, 0 = off */
+    double predict_slope; /* C/s that counts as heating fast */
+    int feedforward;    /* pwm added at 100% CPU load, 0 = off */
+    int feedforward_threshold; /* % load where the boost starts */
+    struct sensor_rule sensor_rules[SENSOR_RULES_MAX];
+    int nsensor_rules;
+};
+
+/* Adaptive tick scheduling state */
+struct tick_sched {
+    int interval;       /* Current interval (ms) */
+    int timer_fd;       /* CLOCK_MONOTONIC timerfd, -1 to fall back to poll() timeouts */
+    long long deadline; /* Next tick (ms, CLOCK_MONOTONIC) */
+};
+
+/* A sysfs attribute kept open across reads/writes */
+struct sysfs_handle {
+    char path[512];
+    int flags;          /* open(2) flags */
+    int fd;             /* -1 if not open */
+    unsigned int opens; /* bumped on every open, fd numbers get reused */
+};
+
+#define SYSFS_HANDLE_INIT { .path = "", .flags = 0, .fd = -1, .opens = 0 }
+
+struct pwm_paths {
+    char base[512];
+    struct sysfs_handle pwm1;
+    struct sysfs_handle pwm2;
+    struct sysfs_handle pwm1_enable;
+    struct sysfs_handle pwm2_enable;
+    struct sysfs_handle pwm_all;
+    struct sysfs_handle ec_temp;
+    int has_pwm2;
+    int has_pwm_all;    /* both fans in one write (uniwill_ibg10_fanctl) */
+    int has_events;     /* module notifies ec_temp (uniwill_ibg10_fanctl) */
+    int has_temp_max;   /* temp1_max exists, so the module does notify */
+};
+
+/* CPU load from PSI, or /proc/stat utilization where PSI is disabled */
+struct load_source {
+    struct sysfs_handle h;
+    int psi;            /* h is /proc/pressure/cpu */
+    unsigned long long prev_busy;   /* PSI: stall us; stat: busy jiffies */
+    unsigned long long prev_total;  /* PSI: monotonic us; stat: all jiffies */
+    long long above_since;          /* ms the load went above the threshold, 0 if below */
+};
+
+/* File descriptors multiplexed by the main loop, -1 if unavailable */
+struct event_loop {
+    int epoll_fd;
+    int signal_fd;      /* SIGINT/SIGTERM/SIGHUP */
+    int uevent_fd;      /* kernel uevents, to follow hwmon hotplug */
+    int ec_temp_fd;     /* pwm_sink.ec_temp.fd as currently registered */
+    unsigned int ec_temp_opens;
+    int profile_fd;     /* platform_profile, sysfs_notify() raises POLLPRI */
+    int status_fd;      /* listening status socket */
+};
+
+#define METRICS_MAGIC   0x31465755  /* "UWF1" */
+#define METRICS_VERSION 1
+#define METRICS_SLOTS   256
+#define METRICS_NONE    INT32_MIN   /* no value for this field */
+
+/*
+ * One tick as published in the metrics ring. Sensor values are the
+ * weighted readings in millidegrees, in the order the status socket lists
+ * them. The writer makes seq odd while it fills the slot; readers keep a
+ * copy only if seq was even and unchanged across it.
+ */
+struct metrics_sample {
+    uint32_t seq;
+    uint32_t tick_us;       /* wakeup to pwm written */
+    int64_t time_ms;        /* CLOCK_MONOTONIC */
+    int32_t temp[2];        /* filtered CPU/GPU temperature (C) */
+    int32_t target[2];      /* fan 1/fan 2 pwm */
+    int32_t commanded[2];   /* last pwm written, -1 if unknown */
+    int32_t current[2];     /* pwm read back, the commanded value between readbacks */
+    uint32_t nsensors;
+    int32_t sensor[SENSOR_MAX];
+};
+
+/* Start of METRICS_PATH, followed by nslots struct metrics_sample */
+struct metrics_header {
+    uint32_t magic;         /* written last, once the header is valid */
+    uint32_t version;
+    uint32_t sample_size;
+    uint32_t nslots;
+    uint64_t head;          /* samples published, the newest is slot (head - 1) % nslots */
+};
+
+/* Per-tick publishing state, hdr is NULL without a metrics file */
+struct metrics {
+    struct metrics_header *hdr;
+    struct metrics_sample *ring;
+    struct metrics_sample last;     /* for the status socket */
+    uint64_t ticks;
+    long long started;              /* ms, CLOCK_MONOTONIC */
+};
+
+#define TRACE_MAGIC     0x31525455  /* "UTR1" */
+#define TRACE_VERSION   1
+
+/* A sensor as found while recording; trace_record.sensor[] is indexed by its slot */
+struct trace_sensor {
+    char name[32];
+    char label[32];
+    int32_t hwmon;
+    uint32_t channel;
+    uint32_t group;         /* enum sensor_group */
+};
+
+/*
+ * Start of a --record trace, followed by struct trace_record up to the end
+ * of the file. Sensors that show up while recording take the next free
+ * slot and the header is rewritten in place.
+ */
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nslots;        /* sensor[] entries in use */
+    uint32_t split;         /* recorded with --split */
+    uint32_t reserved;
+    struct trace_sensor sensor[SENSOR_MAX];
+};
+
+/* One tick of a trace */
+struct trace_record {
+    int64_t time_ms;        /* CLOCK_MONOTONIC */
+    uint32_t tick_us;       /* wakeup to pwm written */
+    int32_t load;           /* CPU load %, -1 if not measured */
+    int32_t pwm[2];         /* fan 1/fan 2 pwm commanded, -1 if unknown */
+    int32_t sensor[SENSOR_MAX]; /* raw readings by slot (millidegrees), METRICS_NONE if not read */
+};
+
+/* --record state, fd -1 when not recording */
+struct trace_writer {
+    int fd;
+    struct trace_header hdr;
+    int slot[SENSOR_MAX];   /* trace slot of sensors[i], -1 once the table is full */
+    unsigned int gen;       /* sensors_gen the slots were mapped for */
+};
+
+/* Parts of a tick that are timed; compute is whatever the others leave */
+enum tick_phase {
+    PHASE_SENSORS,
+    PHASE_COMPUTE,
+    PHASE_READBACK,
+    PHASE_WRITE,
+    PHASE_TICK,         /* wakeup to pwm written */
+    PHASE_MAX,
+};
+
+#define HIST_BUCKETS 24         /* bucket i counts [2^i, 2^(i+1)) us, the last one is open */
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t bucket[HIST_BUCKETS];
+    uint32_t max_us;
+};
+
+/* CLOCK_MONOTONIC timing of the main loop */
+struct tick_timing {
+    long long start;            /* us, start of the current tick */
+    uint32_t phase_us[PHASE_MAX];   /* spent in the current tick */
+    unsigned int ran;           /* phases that ran in the current tick */
+    struct latency_hist hist[PHASE_MAX];
+    uint64_t missed;            /* woke up past deadline + slack, or overran the interval */
+    int late;                   /* the current tick woke up late */
+};
+
+static volatile sig_atomic_t running = 1;
+static int interactive = 0;
+static struct tick_sched sched = {TICK_NORMAL, -1, 0};
+static struct event_loop loop = {-1, -1, -1, -1, 0, -1, -1};
+static struct metrics metrics;
+static struct tick_timing timing;
+static volatile sig_atomic_t stats_requested;   /* SIGUSR1 without a signalfd */
+static struct trace_writer trace = { .fd = -1 };
+static long long replay_clock;          /* --replay: ms of the record being replayed, 0 = real clock */
+static struct fan_config *config;       /* active config, replaced as a whole on reload */
+static const struct curve_set *curves;  /* config->base or the active profile's set */
+static char active_profile[32];         /* platform_profile contents, "" if unknown */
+static const char *config_path = CONFIG_PATH;
+static int config_required;             /* -c given: a missing file is an error */
+static int split_mode;                  /* --split: fan 1 follows CPU, fan 2 follows GPU */
+static const char *record_path;         /* --record trace, NULL if not recording */
+static struct fan_state unified_fan = FAN_STATE_INIT;
+static struct fan_state split_fans[2] = {FAN_STATE_INIT, FAN_STATE_INIT};
+static const char *hwmon_root = HWMON_BASE;     /* --hwmon-root or $UNIWILL_IBG10_FANCTL_HWMON_ROOT */
+static struct hwmon_dev *hwmon_index;  /* every device under hwmon_root */
+static int nhwmon, hwmon_cap;
+static struct sensor sensors[SENSOR_MAX];     /* every tempN_input we aggregate */
+static struct sensor_info sensor_infos[SENSOR_MAX];
+static int nsensors;
+static unsigned int sensors_gen;        /* bumped whenever the sensor set changes */
+static struct temp_filter cpu_filter;
+static struct temp_filter gpu_filter;
+static struct load_source cpu_load = { .h = SYSFS_HANDLE_INIT };
+static struct pwm_paths pwm_sink = {     /* writable PWM device (uniwill_ibg10_fanctl) */
+    .pwm1 = SYSFS_HANDLE_INIT,
+    .pwm2 = SYSFS_HANDLE_INIT,
+    .pwm1_enable = SYSFS_HANDLE_INIT,
+    .pwm2_enable = SYSFS_HANDLE_INIT,
+    .pwm_all = SYSFS_HANDLE_INIT,
+    .ec_temp = SYSFS_HANDLE_INIT,
+};
+
+static void signal_handler(int sig)
+{
+    if (sig == SIGUSR1)
+        stats_requested = 1;
+    else
+        running = 0;
+}
+
+/* Parse a decimal integer as printed by sysfs, -1 on garbage */
+static int parse_int(const char *buf, int *val)
+{
+    const char *p = buf;
+    int neg = 0;
+    int v = 0;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (*p < '0' || *p > '9')
+        return -1;
+    while (*p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+
+    *val = neg ? -v : v;
+    return 0;
+}
+
+/* Format a non-negative integer, returns length */
+static int format_int(char *buf, int val)
+{
+    char tmp[16];
+    int n = 0, len = 0;
+
+    do {
+        tmp[n++] = '0' + val % 10;
+        val /= 10;
+    } while (val > 0 && n < (int)sizeof(tmp));
+
+    while (n > 0)
+        buf[len++] = tmp[--n];
+    buf[len] = '\0';
+    return len;
+}
+
+static void handle_close(struct sysfs_handle *h)
+{
+    if (h->fd >= 0)
+        close(h->fd);
+    h->fd = -1;
+}
+
+/* Point a handle at path and open it once; path "" leaves it unused */
+static int handle_open(struct sysfs_handle *h, const char *path, int flags)
+{
+    handle_close(h);
+    snprintf(h->path, sizeof(h->path), "%s", path);
+    h->flags = flags | O_CLOEXEC;
+    if (!h->path[0])
+        return -1;
+
+    h->fd = open(h->path, h->flags);
+    h->opens++;
+    return h->fd >= 0 ? 0 : -1;
+}
+
+/* The device behind an open attribute went away (module reload, hotplug) */
+static int handle_is_stale(int err)
+{
+    return err == ENODEV || err == ESTALE || err == EBADF || err == ENOENT;
+}
+
+static int handle_reopen(struct sysfs_handle *h)
+{
+    handle_close(h);
+    if (!h->path[0])
+        return -1;
+
+    h->fd = open(h->path, h->flags);
+    h->opens++;
+    return h->fd >= 0 ? 0 : -1;
+}
+
+/* Read the attribute from offset 0, reopening once if the device went away */
+static ssize_t handle_read(struct sysfs_handle *h, char *buf, size_t len)
+{
+    ssize_t n;
+    int retry;
+
+    for (retry = 0; retry < 2; retry++) {
+        if (h->fd < 0 && handle_reopen(h) < 0)
+            return -1;
+
+        n = pread(h->fd, buf, len - 1, 0);
+        if (n >= 0) {
+            buf[n] = '\0';
+            return n;
+        }
+        if (!handle_is_stale(errno))
+            return -1;
+        handle_close(h);
+    }
+
+    return -1;
+}
+
+/* Read integer from sysfs attribute */
+static int handle_read_int(struct sysfs_handle *h)
+{
+    char buf[32];
+    int val;
+
+    if (handle_read(h, buf, sizeof(buf)) < 0 || parse_int(buf, &val) < 0)
+        return -1;
+    return val;
+}
+
+/* Write integer to sysfs attribute */
+static int handle_write_int(struct sysfs_handle *h, int val)
+{
+    char buf[16];
+    int len = format_int(buf, val < 0 ? 0 : val);
+    int retry;
+
+    for (retry = 0; retry < 2; retry++) {
+        if (h->fd < 0 && handle_reopen(h) < 0)
+            return -1;
+
+        if (pwrite(h->fd, buf, len, 0) == len)
+            return 0;
+        if (!handle_is_stale(errno))
+            return -1;
+        handle_close(h);
+    }
+
+    return -1;
+}
+
+/* Read string from sysfs file (one-shot, used during discovery) */
+static int sysfs_read_str(const char *path, char *buf, size_t len)
+{
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    n = pread(fd, buf, len - 1, 0);
+    close(fd);
+    if (n < 0)
+        return -1;
+
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+static int exists(const char *path)
+{
+    return access(path, F_OK) == 0;
+}
+
+/* Fill d from one readdir pass over hwmon_root/dev, -1 if it isn't a device */
+static int hwmon_scan(struct hwmon_dev *d, const char *dev)
+{
+    char path[600], tail[16];
+    struct dirent *ent;
+    unsigned int ch;
+    int n;
+    DIR *dir;
+
+    memset(d, 0, sizeof(*d));
+    if (sscanf(dev, "hwmon%d", &d->num) != 1)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/%s/name", hwmon_root, dev);
+    if (sysfs_read_str(path, d->name, sizeof(d->name)) < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/%s", hwmon_root, dev);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    while ((ent = readdir(dir)) != NULL) {
+        const char *e = ent->d_name;
+
+        if (strcmp(e, "pwm_all") == 0) {
+            d->flags |= HWMON_HAS_PWM_ALL;
+        } else if (sscanf(e, "temp%u_%15s", &ch, tail) == 2 && ch < 32) {
+            if (strcmp(tail, "input") == 0)
+                d->temp_input |= 1u << ch;
+            else if (strcmp(tail, "label") == 0)
+                d->temp_label |= 1u << ch;
+            else if (strcmp(tail, "max") == 0 && ch == 1)
+                d->flags |= HWMON_HAS_TEMP1_MAX;
+        } else if (sscanf(e, "pwm%u_%15s", &ch, tail) == 2 && ch < 32) {
+            if (strcmp(tail, "enable") == 0)
+                d->pwm_enable |= 1u << ch;
+        } else if (sscanf(e, "pwm%u%n", &ch, &n) == 1 && !e[n] && ch < 32) {
+            d->pwm |= 1u << ch;
+            if (faccessat(dirfd(dir), e, W_OK, 0) == 0)
+                d->pwm_writable |= 1u << ch;
+        } else if (sscanf(e, "fan%u_%15s", &ch, tail) == 2 && ch < 32 && strcmp(tail, "input") == 0) {
+            d->fan_input |= 1u << ch;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * The next free index entry, growing the index if it is full. Moves the
+ * entries, so pointers into the index don't survive a call.
+ */
+static struct hwmon_dev *hwmon_index_slot(void)
+{
+    struct hwmon_dev *grown;
+    int cap;
+
+    if (nhwmon < hwmon_cap)
+        return &hwmon_index[nhwmon];
+
+    cap = hwmon_cap ? hwmon_cap * 2 : HWMON_INIT;
+    grown = realloc(hwmon_index, cap * sizeof(*grown));
+    if (!grown) {
+        fprintf(stderr, "Warning: out of memory, indexing only %d hwmon devices\n", nhwmon);
+        return NULL;
+    }
+    hwmon_index = grown;
+    hwmon_cap = cap;
+    return &hwmon_index[nhwmon];
+}
+
+/* Index every hwmon device in one walk of hwmon_root */
+static int hwmon_index_build(void)
+{
+    struct hwmon_dev *d;
+    struct dirent *ent;
+    DIR *dir;
+
+    nhwmon = 0;
+    dir = opendir(hwmon_root);
+    if (!dir)
+        return -1;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "hwmon", 5) != 0)
+            continue;
+        d = hwmon_index_slot();
+        if (!d)
+            break;
+        if (hwmon_scan(d, ent->d_name) == 0)
+            nhwmon++;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static struct hwmon_dev *hwmon_lookup(const char *dev)
+{
+    int num, i;
+
+    if (sscanf(dev, "hwmon%d", &num) != 1)
+        return NULL;
+    for (i = 0; i < nhwmon; i++) {
+        if (hwmon_index[i].num == num)
+            return &hwmon_index[i];
+    }
+    return NULL;
+}
+
+/* Hotplug: (re)index one device, NULL if it can't be read */
+static struct hwmon_dev *hwmon_index_add(const char *dev)
+{
+    struct hwmon_dev *d = hwmon_lookup(dev);
+
+    if (!d) {
+        d = hwmon_index_slot();
+        if (!d || hwmon_scan(d, dev) < 0)
+            return NULL;
+        nhwmon++;
+        return d;
+    }
+
+    if (hwmon_scan(d, dev) < 0) {
+        *d = hwmon_index[--nhwmon];
+        return NULL;
+    }
+    return d;
+}
+
+static void hwmon_index_remove(const char *dev)
+{
+    struct hwmon_dev *d = hwmon_lookup(dev);
+
+    if (d)
+        *d = hwmon_index[--nhwmon];
+}
+
+static struct hwmon_dev *hwmon_find_name(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nhwmon; i++) {
+        if (strcmp(hwmon_index[i].name, name) == 0)
+            return &hwmon_index[i];
+    }
+    return NULL;
+}
+
+static struct hwmon_dev *hwmon_find_pwm(void)
+{
+    int i;
+
+    for (i = 0; i < nhwmon; i++) {
+        if (hwmon_index[i].pwm_writable & 0xe)     /* pwm1..pwm3 */
+            return &hwmon_index[i];
+    }
+    return NULL;
+}
+
+static void open_pwm_attr(struct sysfs_handle *h, const char *base, const char *attr, int present, int flags)
+{
+    char path[600];
+
+    snprintf(path, sizeof(path), "%s/%s", base, attr);
+    handle_open(h, present ? path : "", flags);
+}
+
+/* Open the PWM attributes the index says d has, d NULL for no sink */
+static void build_pwm_paths(struct pwm_paths *pp, const struct hwmon_dev *d)
+{
+    static const struct hwmon_dev none;
+    char base[512] = "";
+
+    if (d)
+        snprintf(base, sizeof(base), "%s/hwmon%d", hwmon_root, d->num);
+    else
+        d = &none;
+
+    snprintf(pp->base, sizeof(pp->base), "%s", base);
+    open_pwm_attr(&pp->pwm1, base, "pwm1", d->pwm & (1u << 1), O_RDWR);
+    open_pwm_attr(&pp->pwm1_enable, base, "pwm1_enable", d->pwm_enable & (1u << 1), O_WRONLY);
+    open_pwm_attr(&pp->pwm2, base, "pwm2", d->pwm & (1u << 2), O_RDWR);
+    open_pwm_attr(&pp->pwm2_enable, base, "pwm2_enable", d->pwm_enable & (1u << 2), O_WRONLY);
+    open_pwm_attr(&pp->pwm_all, base, "pwm_all", d->flags & HWMON_HAS_PWM_ALL, O_WRONLY);
+    open_pwm_attr(&pp->ec_temp, base, "temp1_input", d->temp_input & (1u << 1), O_RDONLY);
+    pp->has_pwm2 = pp->pwm2.path[0] && pp->pwm2_enable.path[0];
+    pp->has_pwm_all = pp->has_pwm2 && pp->pwm_all.path[0];
+    pp->has_temp_max = !!(d->flags & HWMON_HAS_TEMP1_MAX);
+    pp->has_events = 0;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    if (replay_clock)
+        return replay_clock;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Add the time since start_us to phase p of the current tick, returns now */
+static long long timing_add(enum tick_phase p, long long start_us)
+{
+    long long now = now_us();
+
+    timing.phase_us[p] += now - start_us;
+    timing.ran |= 1u << p;
+    return now;
+}
+
+static void timing_start(void)
+{
+    timing.start = now_us();
+    memset(timing.phase_us, 0, sizeof(timing.phase_us));
+    timing.ran = 0;
+}
+
+/* A timer wakeup for deadline (ms) later than the timer slack allows is missed */
+static void timing_check_late(const struct tick_sched *ts)
+{
+    timing.late = now_ms() - ts->deadline > ts->interval * TIMER_SLACK_PCT / 100;
+}
+
+static void hist_add(struct latency_hist *h, uint32_t us)
+{
+    int b = us ? 31 - __builtin_clz(us) : 0;
+
+    h->bucket[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+    h->count++;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+/* Upper bound (us) of the bucket holding the pct-th percentile, at most max */
+static uint32_t hist_percentile(const struct latency_hist *h, int pct)
+{
+    uint64_t want = (h->count * pct + 99) / 100, seen = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS - 1; b++) {
+        seen += h->bucket[b];
+        if (seen >= want)
+            break;
+    }
+    if (b == HIST_BUCKETS - 1 || (2u << b) - 1 > h->max_us)
+        return h->max_us;
+    return (2u << b) - 1;
+}
+
+/* Close the current tick that asked for interval ms and file its phases */
+static void timing_end(int interval)
+{
+    enum tick_phase p;
+
+    timing.phase_us[PHASE_TICK] = now_us() - timing.start;
+    timing.phase_us[PHASE_COMPUTE] = timing.phase_us[PHASE_TICK] - timing.phase_us[PHASE_SENSORS] -
+                                     timing.phase_us[PHASE_READBACK] - timing.phase_us[PHASE_WRITE];
+    timing.ran |= 1u << PHASE_COMPUTE | 1u << PHASE_TICK;
+
+    for (p = 0; p < PHASE_MAX; p++) {
+        if (timing.ran & (1u << p))
+            hist_add(&timing.hist[p], timing.phase_us[p]);
+    }
+    if (timing.late || timing.phase_us[PHASE_TICK] > (uint32_t)interval * 1000)
+        timing.missed++;
+    timing.late = 0;
+}
+
+static const char *const phase_names[PHASE_MAX] = {
+    [PHASE_SENSORS] = "sensors",
+    [PHASE_COMPUTE] = "compute",
+    [PHASE_READBACK] = "readback",
+    [PHASE_WRITE] = "write",
+    [PHASE_TICK] = "tick",
+};
+
+/* Append "<prefix><phase> count p50 p99 max" lines and the missed deadlines to buf */
+static size_t format_timing(char *buf, size_t size, const char *prefix)
+{
+    const struct latency_hist *h;
+    size_t len = 0;
+    enum tick_phase p;
+
+    for (p = 0; p < PHASE_MAX && len < size; p++) {
+        h = &timing.hist[p];
+        len += snprintf(buf + len, size - len, "%s%-8s %8llu %8u %8u %8u\n", prefix, phase_names[p],
+                        (unsigned long long)h->count, hist_percentile(h, 50), hist_percentile(h, 99),
+                        h->max_us);
+    }
+    if (len < size)
+        len += snprintf(buf + len, size - len, "%smissed   %8llu\n", prefix, (unsigned long long)timing.missed);
+    return len < size ? len : size;
+}
+
+static void filter_reset(struct temp_filter *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+/* ms spent suspended since boot: CLOCK_BOOTTIME keeps counting, CLOCK_MONOTONIC doesn't */
+static long long suspended_ms(void)
+{
+    struct timespec boot, mono;
+
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (long long)(boot.tv_sec - mono.tv_sec) * 1000 + (boot.tv_nsec - mono.tv_nsec) / 1000000;
+}
+
+static int filter_sample(const struct temp_filter *f, unsigned int age)
+{
+    return f->samples[(f->head - 1 - age) & (FILTER_RING - 1)];
+}
+
+/* Median of the last n samples (n <= FILTER_RING) */
+static int filter_median(const struct temp_filter *f, unsigned int n)
+{
+    int v[FILTER_RING];
+    unsigned int i, j;
+    int x;
+
+    if (n > f->count)
+        n = f->count;
+
+    for (i = 0; i < n; i++) {
+        x = filter_sample(f, i);
+        for (j = i; j > 0 && v[j - 1] > x; j--)
+            v[j] = v[j - 1];
+        v[j] = x;
+    }
+
+    return v[n / 2];
+}
+
+/* Add a raw sample and return the filtered temperature (millidegrees) */
+static int filter_push(const struct filter_config *fc, struct temp_filter *f, int mdeg, long long now)
+{
+    double weight;
+
+    f->samples[f->head & (FILTER_RING - 1)] = mdeg;
+    f->stamps[f->head & (FILTER_RING - 1)] = now;
+    f->head++;
+    if (f->count < FILTER_RING)
+        f->count++;
+
+    switch (fc->kind) {
+    case FILTER_EMA:
+    case FILTER_ASYMMETRIC:
+        if (f->count == 1) {
+            f->value = mdeg;
+            break;
+        }
+        if (fc->kind == FILTER_EMA)
+            weight = fc->alpha;
+        else
+            weight = mdeg > f->value ? fc->attack : fc->release;
+        f->value += (mdeg - f->value) * weight;
+        break;
+    case FILTER_MEDIAN:
+        f->value = filter_median(f, fc->window);
+        break;
+    default:
+        f->value = mdeg;
+        break;
+    }
+
+    return (int)(f->value + 0.5);
+}
+
+/* Least-squares slope of the samples in the last window_ms, C/s (0 if too few) */
+static double filter_slope(const struct temp_filter *f, long long window_ms)
+{
+    long long t0 = 0;
+    double n = 0, st = 0, sv = 0, stt = 0, stv = 0, t, v;
+    unsigned int i;
+
+    for (i = 0; i < f->count; i++) {
+        unsigned int slot = (f->head - 1 - i) & (FILTER_RING - 1);
+
+        if (i == 0)
+            t0 = f->stamps[slot];
+        else if (t0 - f->stamps[slot] > window_ms)
+            break;
+
+        t = (f->stamps[slot] - t0) / 1000.0;
+        v = f->samples[slot] / 1000.0;
+        n++;
+        st += t;
+        sv += v;
+        stt += t * t;
+        stv += t * v;
+    }
+
+    if (n < 3 || n * stt - st * st <= 0)
+        return 0;
+    return (n * stv - st * sv) / (n * stt - st * st);
+}
+
+/*
+ * Opt-in: while the source heats faster than predict_slope, feed the
+ * controller the temperature it will have predict_ahead seconds from now,
+ * so the fans are already up when the heat arrives.
+ */
+static int predict_temp(const struct temp_filter *f, int temp)
+{
+    double slope;
+
+    if (temp < 0 || !config->predict_ahead)
+        return temp;
+
+    slope = filter_slope(f, PREDICT_WINDOW_MS);
+    if (slope <= config->predict_slope)
+        return temp;
+
+    return temp + (int)(slope * config->predict_ahead + 0.5);
+}
+
+/* Cumulative busy/total counters of the load source, -1 if unreadable */
+static int load_read(struct load_source *ls, unsigned long long *busy, unsigned long long *total)
+{
+    unsigned long long v[8] = {0};
+    char buf[256];
+    const char *p;
+    int i;
+
+    if (handle_read(&ls->h, buf, sizeof(buf)) < 0)
+        return -1;
+
+    if (ls->psi) {
+        /* "some avg10=0.00 avg60=0.00 avg300=0.00 total=12345" */
+        p = strstr(buf, "total=");
+        if (!p)
+            return -1;
+        *busy = strtoull(p + 6, NULL, 10);
+        *total = (unsigned long long)now_ms() * 1000;
+        return 0;
+    }
+
+    /* "cpu  user nice system idle iowait irq softirq steal ..." */
+    if (strncmp(buf, "cpu ", 4) != 0)
+        return -1;
+    p = buf + 4;
+    for (i = 0; i < 8; i++) {
+        char *end;
+
+        v[i] = strtoull(p, &end, 10);
+        if (end == p)
+            break;
+        p = end;
+    }
+    *busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+    *total = *busy + v[3] + v[4];
+    return 0;
+}
+
+/*
+ * CPU load (%) since the previous call, -1 on the first one or if there is
+ * no load source. Only measured for feed-forward or a recording. One pread
+ * per tick.
+ */
+static int load_sample(struct load_source *ls)
+{
+    unsigned long long busy, total;
+    int load;
+
+    if (!config->feedforward && trace.fd < 0)
+        return -1;
+
+    if (!ls->h.path[0]) {
+        ls->psi = handle_open(&ls->h, PSI_CPU_PATH, O_RDONLY) == 0;
+        if (!ls->psi && handle_open(&ls->h, PROC_STAT_PATH, O_RDONLY) < 0)
+            return -1;
+        ls->prev_total = 0;
+    }
+
+    if (load_read(ls, &busy, &total) < 0)
+        return -1;
+
+    if (!ls->prev_total || total <= ls->prev_total || busy < ls->prev_busy) {
+        ls->prev_busy = busy;
+        ls->prev_total = total;
+        return -1;
+    }
+
+    load = (int)((busy - ls->prev_busy) * 100 / (total - ls->prev_total));
+    ls->prev_busy = busy;
+    ls->prev_total = total;
+    return load;
+}
+
+/*
+ * Feed-forward: PWM to add while the CPU has been loaded above the
+ * threshold for FEEDFORWARD_SUSTAIN_MS, scaling up to config->feedforward at
+ * 100%. Temperature lags load by seconds; this gets the fans going first
+ * and drops away as soon as the load does.
+ */
+static int load_boost(struct load_source *ls, int load)
+{
+    long long now = now_ms();
+    int threshold = config->feedforward_threshold;
+
+    if (!config->feedforward || load < 0)
+        return 0;
+
+    if (load <= threshold) {
+        ls->above_since = 0;
+        return 0;
+    }
+    if (!ls->above_since)
+        ls->above_since = now;
+    if (now - ls->above_since < FEEDFORWARD_SUSTAIN_MS)
+        return 0;
+
+    if (load > 100)
+        load = 100;
+    return config->feedforward * (load - threshold) / (100 - threshold);
+}
+
+/* Filter an aggregated reading (millidegrees) into degrees C, -1 if none */
+static int get_temp(struct temp_filter *f, int mdeg)
+{
+    if (mdeg < 0)
+        return -1;
+
+    /* Round, don't truncate: 61.9 C is 62 C for the curve */
+    return (filter_push(&config->filter, f, mdeg, now_ms()) + 500) / 1000;
+}
+
+/* Piecewise linear between the points, flat beyond the first and last one */
+static int curve_interpolate(const struct fan_curve *c, int temp)
+{
+    const struct curve_point *lo, *hi;
+    int i;
+
+    if (temp <= c->points[0].temp)
+        return c->points[0].pwm;
+
+    for (i = 1; i < c->npoints; i++) {
+        lo = &c->points[i - 1];
+        hi = &c->points[i];
+        if (temp <= hi->temp)
+            return lo->pwm + (hi->pwm - lo->pwm) * (temp - lo->temp) / (hi->temp - lo->temp);
+    }
+
+    return c->points[c->npoints - 1].pwm;
+}
+
+static void curve_compile(struct fan_curve *c)
+{
+    int t, v;
+
+    for (t = 0; t < CURVE_LUT_SIZE; t++) {
+        v = curve_interpolate(c, t);
+        c->up[t] = v < c->min_speed ? c->min_speed : v;
+        v = curve_interpolate(c, t + c->hysteresis);
+        c->down[t] = v < c->min_speed ? c->min_speed : v;
+    }
+}
+
+static void curve_set_defaults(struct fan_curve *c)
+{
+    static const struct curve_point defaults[] = {
+        {TEMP_SILENT, SPEED_MIN},
+        {TEMP_LOW, SPEED_LOW},
+        {TEMP_MED, SPEED_MED},
+        {TEMP_HIGH, SPEED_HIGH},
+        {TEMP_MAX, SPEED_MAX},
+    };
+
+    memset(c, 0, sizeof(*c));
+    memcpy(c->points, defaults, sizeof(defaults));
+    c->npoints = sizeof(defaults) / sizeof(defaults[0]);
+    c->hysteresis = HYSTERESIS;
+    c->min_speed = SPEED_MIN;
+    c->controller = 0;
+    c->setpoint = PID_SETPOINT;
+    c->kp = PID_KP;
+    c->ki = PID_KI;
+    c->kd = PID_KD;
+    c->slew_up = 0;
+    c->slew_down = 0;
+}
+
+static int parse_config_int(const char *s, int min, int max, int *val)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno || end == s || v < min || v > max)
+        return -1;
+
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (*end)
+        return -1;
+
+    *val = (int)v;
+    return 0;
+}
+
+static int parse_config_double(const char *s, double max, double *val)
+{
+    char *end;
+    double v;
+
+    errno = 0;
+    v = strtod(s, &end);
+    if (errno || end == s || !(v >= 0 && v <= max))
+        return -1;
+
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (*end)
+        return -1;
+
+    *val = v;
+    return 0;
+}
+
+static int find_controller(const char *name);
+static void sensor_apply_rules(int i);
+
+/* "k10temp/Tctl 100 -5": later rules override earlier ones */
+static int parse_sensor_rule(struct fan_config *cfg, char *value)
+{
+    struct sensor_rule *r;
+    char *args, *offset, *label;
+    int off = 0;
+
+    if (cfg->nsensor_rules >= SENSOR_RULES_MAX)
+        return -1;
+    r = &cfg->sensor_rules[cfg->nsensor_rules];
+
+    args = value + strcspn(value, " \t");
+    if (!*args)
+        return -1;
+    *args++ = '\0';
+    args += strspn(args, " \t");
+
+    offset = args + strcspn(args, " \t");
+    if (*offset) {
+        *offset++ = '\0';
+        if (parse_config_int(offset + strspn(offset, " \t"), -50, 50, &off) < 0)
+            return -1;
+    }
+    if (parse_config_int(args, 0, 200, &r->weight) < 0)
+        return -1;
+    r->offset = off * 1000;
+
+    label = strchr(value, '/');
+    if (label)
+        *label++ = '\0';
+    snprintf(r->name, sizeof(r->name), "%s", value);
+    snprintf(r->label, sizeof(r->label), "%s", label ? label : "");
+
+    cfg->nsensor_rules++;
+    return 0;
+}
+
+/* Top level filter keys */
+static int parse_filter_line(struct filter_config *fc, const char *key, const char *value)
+{
+    static const char *const kinds[] = {"none", "ema", "median", "asymmetric"};
+    size_t i;
+
+    if (strcmp(key, "filter") == 0) {
+        for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+            if (strcmp(value, kinds[i]) == 0) {
+                fc->kind = (enum filter_kind)i;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    if (strcmp(key, "filter_alpha") == 0)
+        return parse_config_double(value, 1, &fc->alpha);
+    if (strcmp(key, "filter_window") == 0)
+        return parse_config_int(value, 1, FILTER_RING, &fc->window);
+    if (strcmp(key, "filter_attack") == 0)
+        return parse_config_double(value, 1, &fc->attack);
+    if (strcmp(key, "filter_release") == 0)
+        return parse_config_double(value, 1, &fc->release);
+    return -1;
+}
+
+/* Handle one "key = value" line of a curve section, -1 on error */
+static int parse_config_line(struct fan_curve *c, char *key, char *value, int *have_points)
+{
+    struct curve_point *pt;
+    char *sep;
+
+    if (strcmp(key, "hysteresis") == 0)
+        return parse_config_int(value, 0, 50, &c->hysteresis);
+    if (strcmp(key, "min_speed") == 0)
+        return parse_config_int(value, 0, 255, &c->min_speed);
+    if (strcmp(key, "controller") == 0)
+        return (c->controller = find_controller(value)) < 0 ? -1 : 0;
+    if (strcmp(key, "setpoint") == 0)
+        return parse_config_int(value, 0, CURVE_LUT_SIZE - 1, &c->setpoint);
+    if (strcmp(key, "kp") == 0)
+        return parse_config_double(value, 1000, &c->kp);
+    if (strcmp(key, "ki") == 0)
+        return parse_config_double(value, 1000, &c->ki);
+    if (strcmp(key, "kd") == 0)
+        return parse_config_double(value, 1000, &c->kd);
+    if (strcmp(key, "slew_up") == 0)
+        return parse_config_int(value, 0, 1000, &c->slew_up);
+    if (strcmp(key, "slew_down") == 0)
+        return parse_config_int(value, 0, 1000, &c->slew_down);
+    if (strcmp(key, "point") != 0)
+        return -1;
+
+    /* The first point replaces the built-in curve */
+    if (!*have_points) {
+        c->npoints = 0;
+        *have_points = 1;
+    }
+    if (c->npoints >= CURVE_MAX_POINTS)
+        return -1;
+
+    sep = value + strcspn(value, " \t");
+    if (!*sep)
+        return -1;
+    *sep++ = '\0';
+
+    pt = &c->points[c->npoints];
+    if (parse_config_int(value, 0, CURVE_LUT_SIZE - 1, &pt->temp) < 0 ||
+        parse_config_int(sep + strspn(sep, " \t"), 0, 255, &pt->pwm) < 0)
+        return -1;
+    if (c->npoints > 0 && pt->temp <= c->points[c->npoints - 1].temp)
+        return -1;
+
+    c->npoints++;
+    return 0;
+}
+
+static char *trim(char *str)
+{
+    char *end;
+
+    str += strspn(str, " \t");
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+        *--end = '\0';
+    return str;
+}
+
+/*
+ * Enter the section named by "[...]" in line: [cpu], [gpu], [profile NAME],
+ * [profile NAME cpu] or [profile NAME gpu]. A new profile starts out as a
+ * copy of the top level curves, so its sections have to come after those.
+ * Returns the curve the following keys go to, NULL if the section is
+ * unknown or repeated.
+ */
+static struct fan_curve *config_section(struct fan_config *cfg, char *line,
+                                        unsigned char seen[PROFILE_MAX + 1][3])
+{
+    struct curve_set *set = &cfg->base;
+    char *word, *name = NULL, *save;
+    size_t len = strlen(line);
+    int s = 0, i;
+
+    if (len < 2 || line[len - 1] != ']')
+        return NULL;
+    line[len - 1] = '\0';
+
+    word = strtok_r(line + 1, " \t", &save);
+    if (word && strcmp(word, "profile") == 0) {
+        name = strtok_r(NULL, " \t", &save);
+        if (!name || strlen(name) >= sizeof(cfg->profiles[0].name))
+            return NULL;
+        word = strtok_r(NULL, " \t", &save);
+    } else if (cfg->nprofiles) {
+        return NULL;
+    }
+    if (word && strtok_r(NULL, " \t", &save))
+        return NULL;
+
+    i = !word ? 0 : strcmp(word, "cpu") == 0 ? 1 : strcmp(word, "gpu") == 0 ? 2 : -1;
+    if (i < 0)
+        return NULL;
+
+    if (name) {
+        for (s = 0; s < cfg->nprofiles; s++) {
+            if (strcmp(cfg->profiles[s].name, name) == 0)
+                break;
+        }
+        if (s == cfg->nprofiles) {
+            if (s >= PROFILE_MAX)
+                return NULL;
+            strcpy(cfg->profiles[s].name, name);
+            set = &cfg->profiles[s].set;
+            set->unified = cfg->base.unified;
+            set->fan[0] = seen[0][1] ? cfg->base.fan[0] : cfg->base.unified;
+            set->fan[1] = seen[0][2] ? cfg->base.fan[1] : cfg->base.unified;
+            cfg->nprofiles++;
+        }
+        set = &cfg->profiles[s].set;
+        s++;
+    }
+
+    if (seen[s][i])
+        return NULL;
+    seen[s][i] = 1;
+    if (i == 0)
+        return &set->unified;
+
+    /* A profile's fan sections build on its own top level curve, if it has one */
+    if (s == 0 || seen[s][0])
+        set->fan[i - 1] = set->unified;
+    return &set->fan[i - 1];
+}
+
+/*
+ * Parse and compile the config. Lines are "key = value", '#' starts a
+ * comment:
+ *
+ *   point = <temp C> <pwm 0-255>   (repeat, temperatures ascending)
+ *   hysteresis = <C>
+ *   min_speed = <pwm 0-255>
+ *   controller = curve | pid
+ *   setpoint = <C>                 (pid)
+ *   kp / ki / kd = <gain>          (pid)
+ *   slew_up / slew_down = <pwm per second, 0 = unlimited>
+ *   coupling = <0-100>             (top level only)
+ *   filter = none | ema | median | asymmetric   (top level only)
+ *   filter_alpha / filter_window / filter_attack / filter_release
+ *   predict_ahead = <s, 0 = off>   (top level only)
+ *   predict_slope = <C/s>          (top level only)
+ *   feedforward = <pwm at 100% load, 0 = off>  (top level only)
+ *   feedforward_threshold = <%>    (top level only)
+ *   sensor = <hwmon name>[/<label>] <weight %> [<offset C>]  (top level, repeat)
+ *
+ * [cpu] and [gpu] sections after the top level keys start as a copy of it
+ * and override the curve of one fan in split mode. A missing file gives
+ * the built-in curve unless -c asked for it.
+ */
+static struct fan_config *load_config(const char *path, int required)
+{
+    struct fan_config *cfg;
+    struct fan_curve *c;
+    char line[256];
+    char *key, *value;
+    unsigned char seen[PROFILE_MAX + 1][3];
+    int lineno = 0, have_points = 0;
+    int i, j, ok = 1;
+    FILE *f;
+
+    cfg = malloc(sizeof(*cfg));
+    if (!cfg)
+        return NULL;
+    curve_set_defaults(&cfg->base.unified);
+    cfg->nprofiles = 0;
+    cfg->coupling = 0;
+    cfg->filter.kind = FILTER_NONE;
+    cfg->filter.alpha = FILTER_ALPHA;
+    cfg->filter.window = FILTER_WINDOW;
+    cfg->filter.attack = FILTER_ATTACK;
+    cfg->filter.release = FILTER_RELEASE;
+    cfg->predict_ahead = 0;
+    cfg->predict_slope = PREDICT_SLOPE;
+    cfg->feedforward = 0;
+    cfg->feedforward_threshold = FEEDFORWARD_THRESHOLD;
+    cfg->nsensor_rules = 0;
+    c = &cfg->base.unified;
+    memset(seen, 0, sizeof(seen));
+    seen[0][0] = 1;         /* the top level needs no section header */
+
+    f = fopen(path, "re");
+    if (!f) {
+        if (errno != ENOENT || required) {
+            fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+            free(cfg);
+            return NULL;
+        }
+    }
+
+    while (f && ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        key = trim(line);
+        if (!*key)
+            continue;
+
+        if (*key == '[') {
+            c = config_section(cfg, key, seen);
+            ok = c != NULL;
+            have_points = 0;
+            continue;
+        }
+
+        value = strchr(key, '=');
+        if (!value) {
+            ok = 0;
+            break;
+        }
+        *value++ = '\0';
+        key = trim(key);
+        value = trim(value);
+
+        if (strcmp(key, "coupling") == 0)
+            ok = c == &cfg->base.unified && parse_config_int(value, 0, 100, &cfg->coupling) == 0;
+        else if (strncmp(key, "filter", 6) == 0)
+            ok = c == &cfg->base.unified && parse_filter_line(&cfg->filter, key, value) == 0;
+        else if (strcmp(key, "predict_ahead") == 0)
+            ok = c == &cfg->base.unified && parse_config_int(value, 0, PREDICT_MAX_AHEAD, &cfg->predict_ahead) == 0;
+        else if (strcmp(key, "predict_slope") == 0)
+            ok = c == &cfg->base.unified && parse_config_double(value, 100, &cfg->predict_slope) == 0;
+        else if (strcmp(key, "feedforward") == 0)
+            ok = c == &cfg->base.unified && parse_config_int(value, 0, 255, &cfg->feedforward) == 0;
+        else if (strcmp(key, "feedforward_threshold") == 0)
+            ok = c == &cfg->base.unified && parse_config_int(value, 0, 99, &cfg->feedforward_threshold) == 0;
+        else if (strcmp(key, "sensor") == 0)
+            ok = c == &cfg->base.unified && parse_sensor_rule(cfg, value) == 0;
+        else
+            ok = parse_config_line(c, key, value, &have_points) == 0;
+    }
+    if (f)
+        fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Error: %s:%d: invalid line\n", path, lineno);
+        free(cfg);
+        return NULL;
+    }
+
+    /* Fans without a section follow their set's top level curve */
+    for (i = 0; i <= cfg->nprofiles; i++) {
+        struct curve_set *set = i ? &cfg->profiles[i - 1].set : &cfg->base;
+
+        for (j = 0; j < 2; j++) {
+            if (!seen[i][j + 1] && (i == 0 || seen[i][0]))
+                set->fan[j] = set->unified;
+        }
+    }
+
+    for (i = 0; i < 3 * (cfg->nprofiles + 1); i++) {
+        struct curve_set *set = i >= 3 ? &cfg->profiles[i / 3 - 1].set : &cfg->base;
+
+        c = i % 3 < 2 ? &set->fan[i % 3] : &set->unified;
+        if (c->npoints < 1) {
+            fprintf(stderr, "Error: %s: no curve points\n", path);
+            free(cfg);
+            return NULL;
+        }
+        curve_compile(c);
+    }
+
+    return cfg;
+}
+
+/* Point curves at the set for the active platform profile, or the top level */
+static void select_curves(void)
+{
+    int i;
+
+    curves = &config->base;
+    for (i = 0; i < config->nprofiles; i++) {
+        if (strcmp(config->profiles[i].name, active_profile) == 0) {
+            curves = &config->profiles[i].set;
+            break;
+        }
+    }
+}
+
+/*
+ * Re-read platform_profile after a POLLPRI (which also re-arms the
+ * notification) and switch curves. Returns 1 if the profile changed.
+ */
+static int update_profile(void)
+{
+    char buf[sizeof(active_profile)];
+    ssize_t n;
+
+    if (loop.profile_fd < 0)
+        return 0;
+
+    n = pread(loop.profile_fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0)
+        return 0;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    if (strcmp(buf, active_profile) == 0)
+        return 0;
+
+    strcpy(active_profile, buf);
+    select_curves();
+    return 1;
+}
+
+/* Swap in a freshly loaded config, keeping the old one if the file is bad */
+static int reload_config(void)
+{
+    struct fan_config *cfg = load_config(config_path, config_required);
+    int i;
+
+    if (!cfg)
+        return -1;
+
+    free(config);
+    config = cfg;
+    select_curves();
+
+    for (i = 0; i < nsensors; i++)
+        sensor_apply_rules(i);
+    return 0;
+}
+
+/*
+ * Controllers turn a temperature into a target PWM. Each keeps whatever
+ * state it needs in struct fan_state; fan->current is the speed the fan is
+ * running at and dt the seconds since the previous run (0 on the first).
+ */
+struct controller {
+    const char *name;
+    int (*target)(const struct fan_curve *c, struct fan_state *fan, int temp, double dt);
+};
+
+/* Curve lookup with step hysteresis */
+static int calc_target(const struct fan_curve *c, struct fan_state *fan, int temp, double dt)
+{
+    int idx = temp < 0 ? 0 : temp >= CURVE_LUT_SIZE ? CURVE_LUT_SIZE - 1 : temp;
+    int target = c->up[idx];
+
+    (void)dt;
+
+    /* Hold the current speed until it's hysteresis degrees cooler */
+    if (target < fan->current && c->down[idx] >= fan->current)
+        target = fan->current;
+
+    return target;
+}
+
+/*
+ * PI(D) towards c->setpoint. The integral only accumulates while the
+ * output isn't saturated, and small corrections are held back so the
+ * fan isn't rewritten every tick for a PWM step nobody can hear.
+ */
+static int pid_target(const struct fan_curve *c, struct fan_state *fan, int temp, double dt)
+{
+    int error = temp - c->setpoint;
+    double out, d = 0;
+    int target;
+
+    /* Bumpless start: continue from the speed the fan has now */
+    if (dt <= 0) {
+        fan->integral = fan->current - c->kp * error;
+        fan->prev_error = error;
+        return fan->current;
+    }
+
+    if (c->kd > 0)
+        d = c->kd * (error - fan->prev_error) / dt;
+    fan->prev_error = error;
+
+    out = c->kp * error + fan->integral + c->ki * error * dt + d;
+    if (out > c->min_speed && out < SPEED_MAX)
+        fan->integral += c->ki * error * dt;
+
+    target = out < c->min_speed ? c->min_speed : out > SPEED_MAX ? SPEED_MAX : (int)(out + 0.5);
+    if (abs(target - fan->current) < PID_MIN_STEP && target != c->min_speed && target != SPEED_MAX)
+        return fan->current;
+
+    return target;
+}
+
+static const struct controller controllers[] = {
+    {"curve", calc_target},
+    {"pid", pid_target},
+};
+
+static int find_controller(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (strcmp(controllers[i].name, name) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+/*
+ * Run the fan's controller, limit how fast its output may move and add the
+ * feed-forward boost on top.
+ */
+static int fan_control(const struct fan_curve *c, struct fan_state *fan, int temp, int boost)
+{
+    long long now = now_ms();
+    double dt = fan->last_control ? (now - fan->last_control) / 1000.0 : 0;
+    int target, step;
+
+    /* Controllers and slew limits see the speed without the last boost */
+    fan->current -= fan->boost;
+    if (fan->current < 0)
+        fan->current = 0;
+    fan->boost = boost;
+
+    fan->last_control = now;
+    target = controllers[c->controller].target(c, fan, temp, dt);
+
+    if (dt <= 0) {
+        /* nothing to limit against yet */
+    } else if (c->slew_up && target > fan->current) {
+        step = (int)(c->slew_up * dt);
+        if (target > fan->current + (step ? step : 1))
+            target = fan->current + (step ? step : 1);
+    } else if (c->slew_down && target < fan->current) {
+        step = (int)(c->slew_down * dt);
+        if (target < fan->current - (step ? step : 1))
+            target = fan->current - (step ? step : 1);
+    }
+
+    return target + boost > SPEED_MAX ? SPEED_MAX : target + boost;
+}
+
+static const char *get_trend(int target, int *prev_target)
+{
+    const char *trend;
+
+    if (*prev_target < 0)
+        trend = " ";
+    else if (target > *prev_target)
+        trend = "^";
+    else if (target < *prev_target)
+        trend = "v";
+    else
+        trend = "=";
+
+    *prev_target = target;
+    return trend;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-c config] [-s] [-H dir] [-r trace | -R trace] [-b ticks] [-h]\n", prog);
+    printf("\n");
+    printf("Silent fan control for TUXEDO InfinityBook Gen10 (hwmon)\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  -c, --config FILE  Fan curve config (default %s, built-in curve if missing)\n", CONFIG_PATH);
+    printf("  -s, --split        Drive the CPU fan from the CPU and the GPU fan from the GPU\n");
+    printf("                     temperature, using the [cpu]/[gpu] curves of the config\n");
+    printf("  -r, --record FILE  Log every tick's raw sensor readings and pwm to a binary trace\n");
+    printf("  -R, --replay FILE  Run a recorded trace through the config and report how the\n");
+    printf("                     fans would have moved, without touching the hardware\n");
+    printf("  -H, --hwmon-root DIR\n");
+    printf("                     Look for hwmon devices in DIR instead of $%s\n", HWMON_ROOT_ENV);
+    printf("                     or %s\n", HWMON_BASE);
+    printf("  -b, --bench N      Time discovery, N back-to-back ticks and config reloads, then exit\n");
+    printf("  -h, --help         Show this help message\n");
+}
+
+/*
+ * hwmon devices whose temperatures we aggregate, and what they heat. Only
+ * temp1 of the devices the daemon always read (Tctl, edge) counts unless the
+ * config gives the other channels a weight.
+ */
+static const struct {
+    const char *name;
+    enum sensor_group group;
+    unsigned int channel;       /* counted by default, 0 = none */
+} sensor_devices[] = {
+    {"k10temp", GROUP_CPU, 1},              /* Tctl */
+    {"uniwill", GROUP_CPU, 1},
+    {"uniwill_ibg10_fanctl", GROUP_CPU, 0}, /* EC temperature */
+    {"nvme", GROUP_CPU, 0},
+    {"amdgpu", GROUP_GPU, 1},               /* edge */
+};
+
+static int sensor_device_index(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(sensor_devices) / sizeof(sensor_devices[0])); i++) {
+        if (strcmp(sensor_devices[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int sensor_device_group(const char *name)
+{
+    int i = sensor_device_index(name);
+
+    return i < 0 ? -1 : (int)sensor_devices[i].group;
+}
+
+/* The default weight, or whatever the last matching config rule says, and its offset */
+static void sensor_apply_rules(int i)
+{
+    const struct sensor_rule *r;
+    int j;
+
+    j = sensor_device_index(sensor_infos[i].name);
+    sensors[i].weight = j >= 0 && sensors[i].channel == (int)sensor_devices[j].channel ? 100 : 0;
+    sensors[i].offset = 0;
+    for (j = 0; j < config->nsensor_rules; j++) {
+        r = &config->sensor_rules[j];
+        if (strcmp(r->name, sensor_infos[i].name) == 0 &&
+            (!r->label[0] || strcmp(r->label, sensor_infos[i].label) == 0)) {
+            sensors[i].weight = r->weight;
+            sensors[i].offset = r->offset;
+        }
+    }
+}
+
+/* Weigh a raw reading (millidegrees) into se and the maximum of its group */
+static void sensor_weigh(struct sensor *se, int raw, int out[2])
+{
+    int v = raw * se->weight / 100 + se->offset;
+
+    se->raw = raw;
+    se->value = v;
+    if (v > out[se->group])
+        out[se->group] = v;
+}
+
+static int sensor_open(const struct sensor *se)
+{
+    char path[600];
+
+    snprintf(path, sizeof(path), "%s/hwmon%d/temp%d_input", hwmon_root, se->hwmon, se->channel);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Add every tempN_input the index lists for d, returns how many */
+static int sensors_add_device(const struct hwmon_dev *d, int group)
+{
+    char path[600], label[32];
+    struct sensor *se;
+    unsigned int channel;
+    int added = 0;
+
+    for (channel = 0; channel < 32 && nsensors < SENSOR_MAX; channel++) {
+        if (!(d->temp_input & (1u << channel)))
+            continue;
+
+        se = &sensors[nsensors];
+        se->hwmon = d->num;
+        se->channel = channel;
+        se->group = group;
+        se->fd = sensor_open(se);
+        if (se->fd < 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/hwmon%d/temp%u_label", hwmon_root, d->num, channel);
+        if (!(d->temp_label & (1u << channel)) || sysfs_read_str(path, label, sizeof(label)) < 0)
+            snprintf(label, sizeof(label), "temp%u", channel);
+        snprintf(sensor_infos[nsensors].name, sizeof(sensor_infos[nsensors].name), "%s", d->name);
+        snprintf(sensor_infos[nsensors].label, sizeof(sensor_infos[nsensors].label), "%s", label);
+        sensor_apply_rules(nsensors);
+        nsensors++;
+        added++;
+    }
+
+    if (added)
+        sensors_gen++;
+    return added;
+}
+
+/* Drop the sensors of hwmon device dev, keeping the array packed */
+static int sensors_remove_device(const char *dev)
+{
+    int hwmon, i, j = 0, removed = 0;
+
+    if (sscanf(dev, "hwmon%d", &hwmon) != 1)
+        return 0;
+
+    for (i = 0; i < nsensors; i++) {
+        if (sensors[i].hwmon == hwmon) {
+            if (sensors[i].fd >= 0)
+                close(sensors[i].fd);
+            removed++;
+            continue;
+        }
+        sensors[j] = sensors[i];
+        sensor_infos[j] = sensor_infos[i];
+        j++;
+    }
+
+    nsensors = j;
+    if (removed)
+        sensors_gen++;
+    return removed;
+}
+
+/*
+ * Read every sensor and aggregate per group: the maximum of
+ * temp * weight / 100 + offset, in millidegrees. -1 for a group with no
+ * readable sensor.
+ */
+static void sensors_read(int out[2])
+{
+    struct sensor *se;
+    char buf[16];
+    ssize_t n;
+    int i, v;
+
+    out[GROUP_CPU] = out[GROUP_GPU] = -1;
+
+    for (i = 0; i < nsensors; i++) {
+        se = &sensors[i];
+        se->raw = se->value = METRICS_NONE;
+        if (!se->weight)
+            continue;
+
+        n = se->fd >= 0 ? pread(se->fd, buf, sizeof(buf) - 1, 0) : -1;
+        if (n < 0 && (se->fd < 0 || handle_is_stale(errno))) {
+            if (se->fd >= 0)
+                close(se->fd);
+            se->fd = sensor_open(se);
+            n = se->fd >= 0 ? pread(se->fd, buf, sizeof(buf) - 1, 0) : -1;
+        }
+        if (n <= 0)
+            continue;
+        buf[n] = '\0';
+        if (parse_int(buf, &v) < 0)
+            continue;
+
+        sensor_weigh(se, v, out);
+    }
+}
+
+/* Build the sensor set from the hwmon index */
+static int select_temp_sources(void)
+{
+    int group, i;
+
+    while (nsensors > 0) {
+        if (sensors[--nsensors].fd >= 0)
+            close(sensors[nsensors].fd);
+    }
+    filter_reset(&cpu_filter);
+    filter_reset(&gpu_filter);
+    sensors_gen++;
+
+    for (i = 0; i < nhwmon; i++) {
+        group = sensor_device_group(hwmon_index[i].name);
+        if (group >= 0)
+            sensors_add_device(&hwmon_index[i], group);
+    }
+
+    return nsensors > 0 ? 0 : -1;
+}
+
+static void print_sensors(const char *label, int group)
+{
+    int i, n = 0;
+
+    printf("  %-19s", label);
+    for (i = 0; i < nsensors; i++) {
+        if (sensors[i].group != group)
+            continue;
+        printf("%s%s/%s", n++ ? ", " : "", sensor_infos[i].name, sensor_infos[i].label);
+        if (sensors[i].weight != 100 || sensors[i].offset)
+            printf(" (%d%% %+d C)", sensors[i].weight, sensors[i].offset / 1000);
+    }
+    printf("%s\n", n ? "" : "none");
+}
+
+static int select_pwm_sink(void)
+{
+    /* Prefer our standalone hwmon device name, otherwise any writable pwm */
+    struct hwmon_dev *d = hwmon_find_name("uniwill_ibg10_fanctl");
+
+    if (!d)
+        d = hwmon_find_pwm();
+
+    build_pwm_paths(&pwm_sink, d);
+    return d ? 0 : -1;
+}
+
+static void print_curve(const char *label, const struct fan_curve *c)
+{
+    int i;
+
+    if (strcmp(controllers[c->controller].name, "pid") == 0) {
+        printf("  %s: PID, setpoint %d C, kp %.2f ki %.2f kd %.2f\n", label, c->setpoint, c->kp, c->ki, c->kd);
+        printf("    minimum speed %d%%", c->min_speed * 100 / 255);
+    } else {
+        printf("  %s:", label);
+        for (i = 0; i < c->npoints; i++)
+            printf("%s %d C %d%%", i ? "," : "", c->points[i].temp, c->points[i].pwm * 100 / 255);
+        printf("\n");
+        printf("    hysteresis %d C, minimum speed %d%%", c->hysteresis, c->min_speed * 100 / 255);
+    }
+    if (c->slew_up || c->slew_down)
+        printf(", slew %d/%d pwm/s up/down", c->slew_up, c->slew_down);
+    printf("\n");
+}
+
+static void print_banner(void)
+{
+    printf("\n");
+    printf("  TUXEDO InfinityBook Gen10 Silent Fan Control (hwmon)\n");
+    printf("  ----------------------------------------------------\n");
+    printf("  Config: %s\n", exists(config_path) ? config_path : "none (built-in curve)");
+    if (config->nprofiles)
+        printf("  Profile: %s (%s)\n", active_profile[0] ? active_profile : "unknown",
+               curves == &config->base ? "top level curve" : "profile curve");
+    if (split_mode) {
+        print_curve("CPU fan curve", &curves->fan[0]);
+        print_curve("GPU fan curve", &curves->fan[1]);
+    } else {
+        print_curve("Fan curve", &curves->unified);
+    }
+    printf("\n");
+    print_sensors("Sensors (CPU):", GROUP_CPU);
+    print_sensors("Sensors (GPU):", GROUP_GPU);
+    printf("  PWM sink:          %s\n", pwm_sink.base[0] ? pwm_sink.base : "none");
+    if (split_mode)
+        printf("  Mode: Split (each fan follows its own sensor, coupling %d%%)\n", config->coupling);
+    else
+        printf("  Mode: Unified (both fans follow max temp - shared heatpipes)\n");
+    if (trace.fd >= 0)
+        printf("  Recording: %s\n", record_path);
+    if (config->feedforward)
+        printf("  Feed-forward: up to +%d%% above %d%% CPU load\n", config->feedforward * 100 / 255,
+               config->feedforward_threshold);
+    printf("  Updates: adaptive, every %d-%d ms%s\n", TICK_FAST, TICK_IDLE_MAX,
+           pwm_sink.has_events ? " + kernel temperature events" : "");
+    printf("\n");
+    printf("  Trend: ^ = ramping up, v = slowing down, = = steady\n");
+    printf("  Ctrl+C to stop and restore automatic control\n");
+    printf("\n");
+    if (split_mode) {
+        printf("Time     | CPU | GPU | CPU fan | GPU fan\n");
+        printf("---------|-----|-----|---------|--------\n");
+    } else {
+        printf("Time     | CPU | GPU | Fan\n");
+        printf("---------|-----|-----|-------\n");
+    }
+}
+
+static int set_manual_mode(void)
+{
+    /* 1 = manual, 2 = auto */
+    int ret = 0;
+
+    if (pwm_sink.pwm1_enable.path[0])
+        ret |= handle_write_int(&pwm_sink.pwm1_enable, 1);
+    if (pwm_sink.has_pwm2)
+        ret |= handle_write_int(&pwm_sink.pwm2_enable, 1);
+
+    return ret;
+}
+
+/* Write a pwm attribute of the sink; a replayed trace has none and every write succeeds */
+static int sink_write(struct sysfs_handle *h, int val)
+{
+    return replay_clock ? 0 : handle_write_int(h, val);
+}
+
+/* Drive both fans to the same target (unified control), skipping no-op writes */
+static void set_unified_target(struct fan_state *fan, int target)
+{
+    long long start;
+    int ret;
+
+    if (target == fan->commanded)
+        return;
+
+    start = now_us();
+    if (pwm_sink.has_pwm_all) {
+        ret = sink_write(&pwm_sink.pwm_all, target);
+    } else {
+        ret = sink_write(&pwm_sink.pwm1, target);
+        if (pwm_sink.has_pwm2)
+            ret |= sink_write(&pwm_sink.pwm2, target);
+    }
+
+    timing_add(PHASE_WRITE, start);
+
+    /* Retry next tick if the write didn't make it */
+    fan->commanded = ret == 0 ? target : -1;
+}
+
+/* Drive a single fan (split mode), skipping no-op writes */
+static void set_fan_target(struct fan_state *fan, struct sysfs_handle *pwm, int target)
+{
+    long long start;
+
+    if (target == fan->commanded)
+        return;
+
+    start = now_us();
+    fan->commanded = sink_write(pwm, target) == 0 ? target : -1;
+    timing_add(PHASE_WRITE, start);
+}
+
+/*
+ * Read the actual PWM back from the EC (averaged over pwm_a and pwm_b if
+ * given). Only needed now and then to notice the EC overriding us; in
+ * between we trust the last commanded value, as a replay always does.
+ */
+static void update_current(struct fan_state *fan, struct sysfs_handle *pwm_a, struct sysfs_handle *pwm_b)
+{
+    int fan_actual1, fan_actual2;
+    long long now = now_ms(), start;
+
+    if (fan->commanded >= 0 && (replay_clock || now - fan->last_readback < READBACK_INTERVAL * 1000)) {
+        fan->current = fan->commanded;
+        return;
+    }
+    fan->last_readback = now;
+
+    start = now_us();
+    fan_actual1 = handle_read_int(pwm_a);
+    if (fan_actual1 < 0)
+        fan_actual1 = 0;
+    fan_actual2 = pwm_b ? handle_read_int(pwm_b) : fan_actual1;
+    if (fan_actual2 < 0)
+        fan_actual2 = fan_actual1;
+    timing_add(PHASE_READBACK, start);
+
+    fan->current = (fan_actual1 + fan_actual2) / 2;
+
+    /* EC changed the speed behind our back, write the target again */
+    if (fan->commanded >= 0 && abs(fan->current - fan->commanded) > READBACK_TOLERANCE)
+        fan->commanded = -1;
+}
+
+/*
+ * uniwill_ibg10_fanctl samples the EC temperature itself and notifies
+ * temp1_input when it moves or crosses temp1_max/temp1_crit. temp1_max only
+ * exists on module versions that do this.
+ */
+static void open_event_source(void)
+{
+    char buf[16];
+
+    if (!pwm_sink.has_temp_max)
+        return;
+
+    /* Reading arms the sysfs poll notification */
+    pwm_sink.has_events = handle_read(&pwm_sink.ec_temp, buf, sizeof(buf)) >= 0;
+}
+
+static int near_knee(const struct fan_curve *c, int temp)
+{
+    int i;
+
+    for (i = 0; i < c->npoints; i++) {
+        if (abs(temp - c->points[i].temp) <= KNEE_MARGIN)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Pick the tick interval a fan asks for: fast while its temperature rises
+ * or sits near a knee of its curve, exponential backoff while it is stable
+ * at the lowest speed, normal otherwise.
+ */
+static int fan_next_interval(const struct tick_sched *ts, const struct fan_curve *c,
+                             struct fan_state *fan, int temp, int target)
+{
+    int prev = fan->prev_temp;
+    int interval;
+
+    fan->prev_temp = temp;
+
+    if ((prev >= 0 && temp > prev) || near_knee(c, temp))
+        interval = TICK_FAST;
+    else if (prev >= 0 && abs(temp - prev) <= 1 && target <= c->up[0])
+        interval = ts->interval < TICK_NORMAL ? TICK_NORMAL : ts->interval * 2;
+    else
+        interval = TICK_NORMAL;
+
+    return interval > TICK_IDLE_MAX ? TICK_IDLE_MAX : interval;
+}
+
+static void sched_update(struct tick_sched *ts, int interval)
+{
+    /* Let the kernel batch our wakeups with others, more so when idle */
+    if (interval != ts->interval)
+        prctl(PR_SET_TIMERSLACK, (unsigned long)interval * 1000000UL * TIMER_SLACK_PCT / 100, 0, 0, 0);
+
+    ts->interval = interval;
+}
+
+static void sched_init(struct tick_sched *ts)
+{
+    ts->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    ts->deadline = now_ms();
+    prctl(PR_SET_TIMERSLACK, (unsigned long)ts->interval * 1000000UL * TIMER_SLACK_PCT / 100, 0, 0, 0);
+}
+
+/* Arm the timer for the next tick, aligned to TICK_GRID */
+static void sched_arm(struct tick_sched *ts)
+{
+    struct itimerspec its;
+    long long now = now_ms();
+
+    ts->deadline += ts->interval;
+    if (ts->deadline < now)
+        ts->deadline = now + ts->interval;
+    ts->deadline = (ts->deadline + TICK_GRID - 1) / TICK_GRID * TICK_GRID;
+
+    if (ts->timer_fd < 0)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ts->deadline / 1000;
+    its.it_value.tv_nsec = (ts->deadline % 1000) * 1000000;
+    timerfd_settime(ts->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Print a notice without letting the interactive status line overwrite it */
+static void log_event(const char *msg, const char *arg)
+{
+    printf("%s %s\n", msg, arg[0] ? arg : "none");
+    if (interactive)
+        printf("\n");
+    fflush(stdout);
+}
+
+/* Tick latency histograms (us), on SIGUSR1 and at exit */
+static void print_timing(void)
+{
+    char buf[1024];
+
+    format_timing(buf, sizeof(buf), "  ");
+    printf("Tick latency (us):\n  %-8s %8s %8s %8s %8s\n%s", "", "count", "p50", "p99", "max", buf);
+    if (interactive)
+        printf("\n");
+    fflush(stdout);
+}
+
+/* Keep the epoll registration in step with the (re)opened temp1_input fd */
+static void loop_sync_ec_temp(void)
+{
+    struct epoll_event ev;
+    int fd = pwm_sink.has_events ? pwm_sink.ec_temp.fd : -1;
+
+    if (loop.epoll_fd < 0 || (fd == loop.ec_temp_fd && pwm_sink.ec_temp.opens == loop.ec_temp_opens))
+        return;
+
+    /* A closed fd drops out of the epoll set by itself, this may fail */
+    if (loop.ec_temp_fd >= 0)
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, loop.ec_temp_fd, NULL);
+    loop.ec_temp_fd = -1;
+    loop.ec_temp_opens = pwm_sink.ec_temp.opens;
+
+    if (fd < 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLPRI | EPOLLERR;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+        loop.ec_temp_fd = fd;
+}
+
+static int loop_add(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (fd < 0)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int open_uevent_socket(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;     /* kernel uevents, not the udev rebroadcast */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Map the metrics ring into METRICS_PATH on tmpfs, where consumers can
+ * mmap() it read-only instead of polling hwmon themselves. The daemon
+ * runs without it if the file can't be created.
+ */
+static void metrics_init(void)
+{
+    size_t size = sizeof(struct metrics_header) + METRICS_SLOTS * sizeof(struct metrics_sample);
+    void *map;
+    int fd;
+
+    metrics.started = now_ms();
+
+    if (mkdir(RUN_DIR, 0755) < 0 && errno != EEXIST)
+        return;
+    fd = open(METRICS_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    metrics.hdr = map;
+    metrics.ring = (struct metrics_sample *)(metrics.hdr + 1);
+    metrics.hdr->version = METRICS_VERSION;
+    metrics.hdr->sample_size = sizeof(struct metrics_sample);
+    metrics.hdr->nslots = METRICS_SLOTS;
+    metrics.hdr->head = 0;
+    __atomic_store_n(&metrics.hdr->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Fill last from the state of the tick that just ended and publish it */
+static void metrics_publish(int cpu_t, int gpu_t, const int targets[2])
+{
+    struct metrics_sample *m = &metrics.last, *slot;
+    const struct fan_state *fan[2];
+    uint32_t seq;
+    uint64_t head;
+    int i;
 
-struct fan_state {
-    int current;        /* Current speed (0-255) */
-    int prev_target;    /* Previous target for trend */
-};
+    fan[0] = split_mode ? &split_fans[0] : &unified_fan;
+    fan[1] = split_mode ? &split_fans[1] : &unified_fan;
+
+    m->time_ms = now_ms();
+    m->tick_us = timing.phase_us[PHASE_TICK];
+    m->temp[0] = cpu_t >= 0 ? cpu_t : METRICS_NONE;
+    m->temp[1] = gpu_t >= 0 ? gpu_t : METRICS_NONE;
+    for (i = 0; i < 2; i++) {
+        m->target[i] = targets[i];
+        m->commanded[i] = fan[i]->commanded;
+        m->current[i] = fan[i]->current;
+    }
+    m->nsensors = nsensors;
+    for (i = 0; i < nsensors; i++)
+        m->sensor[i] = sensors[i].value;
+
+    metrics.ticks++;
+
+    if (!metrics.hdr)
+        return;
+
+    /* Single writer: a seqlock per slot, then advance head */
+    head = metrics.hdr->head;
+    slot = &metrics.ring[head % METRICS_SLOTS];
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + sizeof(slot->seq), (char *)m + sizeof(m->seq), sizeof(*m) - sizeof(m->seq));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&metrics.hdr->head, head + 1, __ATOMIC_RELEASE);
+}
 
-struct temp_paths {
-    char temp[512];
-};
+static void metrics_close(void)
+{
+    if (metrics.hdr) {
+        munmap(metrics.hdr, sizeof(struct metrics_header) + METRICS_SLOTS * sizeof(struct metrics_sample));
+        metrics.hdr = NULL;
+        unlink(METRICS_PATH);
+    }
+    if (loop.status_fd >= 0) {
+        close(loop.status_fd);
+        loop.status_fd = -1;
+        unlink(STATUS_SOCKET);
+    }
+}
 
-struct pwm_paths {
-    char base[512];
-    char pwm1[512];
-    char pwm2[512];
-    char pwm1_enable[512];
-    char pwm2_enable[512];
-    char ec_temp[512];
-    int has_pwm2;
-};
+/* Start a --record trace at path, replacing whatever is there */
+static int trace_open(const char *path)
+{
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd < 0)
+        return -1;
 
-static volatile sig_atomic_t running = 1;
-static int interactive = 0;
-static struct fan_state unified_fan = {0, -1};
-static struct temp_paths cpu_temp_src; /* k10temp or uniwill */
-static struct temp_paths gpu_temp_src; /* amdgpu */
-static struct pwm_paths pwm_sink;      /* writable PWM device (uniwill_ibg10_fanctl) */
+    memset(&trace.hdr, 0, sizeof(trace.hdr));
+    trace.hdr.magic = TRACE_MAGIC;
+    trace.hdr.version = TRACE_VERSION;
+    trace.hdr.record_size = sizeof(struct trace_record);
+    trace.hdr.split = split_mode;
+    trace.gen = sensors_gen - 1;
 
-static void signal_handler(int sig)
+    if (write(trace.fd, &trace.hdr, sizeof(trace.hdr)) != sizeof(trace.hdr)) {
+        close(trace.fd);
+        trace.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void trace_close(void)
 {
-    (void)sig;
-    running = 0;
+    if (trace.fd >= 0)
+        close(trace.fd);
+    trace.fd = -1;
 }
 
-/* Read integer from sysfs file */
-static int sysfs_read_int(const char *path)
+/* Give every sensor its slot in the trace, adding the ones it hasn't seen yet */
+static void trace_map_sensors(void)
 {
-    FILE *f;
-    int val = -1;
+    struct trace_sensor *ts;
+    unsigned int j;
+    int i, added = 0;
+
+    for (i = 0; i < nsensors; i++) {
+        for (j = 0; j < trace.hdr.nslots; j++) {
+            ts = &trace.hdr.sensor[j];
+            if (ts->hwmon == sensors[i].hwmon && ts->channel == sensors[i].channel &&
+                strcmp(ts->name, sensor_infos[i].name) == 0 && strcmp(ts->label, sensor_infos[i].label) == 0)
+                break;
+        }
+        if (j == trace.hdr.nslots && j < SENSOR_MAX) {
+            ts = &trace.hdr.sensor[j];
+            memcpy(ts->name, sensor_infos[i].name, sizeof(ts->name));
+            memcpy(ts->label, sensor_infos[i].label, sizeof(ts->label));
+            ts->hwmon = sensors[i].hwmon;
+            ts->channel = sensors[i].channel;
+            ts->group = sensors[i].group;
+            trace.hdr.nslots++;
+            added = 1;
+        }
+        trace.slot[i] = j < SENSOR_MAX ? (int)j : -1;
+    }
 
-    f = fopen(path, "r");
-    if (f) {
-        if (fscanf(f, "%d", &val) != 1)
-            val = -1;
-        fclose(f);
+    trace.gen = sensors_gen;
+    if (added && pwrite(trace.fd, &trace.hdr, sizeof(trace.hdr), 0) != sizeof(trace.hdr)) {
+        log_event("Recording stopped:", strerror(errno));
+        trace_close();
     }
-    return val;
 }
 
-/* Write integer to sysfs file */
-static int sysfs_write_int(const char *path, int val)
+/* Append the tick metrics.last describes, with load (%) and the raw readings */
+static void trace_write(int load)
 {
-    FILE *f;
-    int ret = -1;
+    const struct metrics_sample *m = &metrics.last;
+    struct trace_record r;
+    int i;
 
-    f = fopen(path, "w");
-    if (f) {
-        if (fprintf(f, "%d", val) > 0)
-            ret = 0;
-        fclose(f);
+    if (trace.fd >= 0 && trace.gen != sensors_gen)
+        trace_map_sensors();
+    if (trace.fd < 0)
+        return;
+
+    r.time_ms = m->time_ms;
+    r.tick_us = m->tick_us;
+    r.load = load;
+    r.pwm[0] = m->commanded[0];
+    r.pwm[1] = m->commanded[1];
+    for (i = 0; i < SENSOR_MAX; i++)
+        r.sensor[i] = METRICS_NONE;
+    for (i = 0; i < nsensors; i++) {
+        if (trace.slot[i] >= 0)
+            r.sensor[trace.slot[i]] = sensors[i].raw;
+    }
+
+    /* A short write leaves a partial record at the end, which replay ignores */
+    if (write(trace.fd, &r, sizeof(r)) != sizeof(r)) {
+        log_event("Recording stopped:", strerror(errno));
+        trace_close();
     }
-    return ret;
 }
 
-/* Read string from sysfs file */
-static int sysfs_read_str(const char *path, char *buf, size_t len)
+static int open_status_socket(void)
 {
-    FILE *f;
+    struct sockaddr_un addr;
+    int fd;
 
-    f = fopen(path, "r");
-    if (!f)
+    if (mkdir(RUN_DIR, 0755) < 0 && errno != EEXIST)
         return -1;
 
-    if (!fgets(buf, len, f)) {
-        fclose(f);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, STATUS_SOCKET);
+    unlink(STATUS_SOCKET);      /* left behind by a previous run */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
         return -1;
     }
+    chmod(STATUS_SOCKET, 0666);
 
-    buf[strcspn(buf, "\n")] = 0;
-    fclose(f);
-    return 0;
+    return fd;
 }
 
-static int is_writable(const char *path)
+/*
+ * Answer every pending connection on the status socket with the state of
+ * the last tick as "key value" lines, then close it. Nothing is read from
+ * sysfs for this.
+ */
+static void handle_status(void)
 {
-    return access(path, W_OK) == 0;
+    const struct metrics_sample *m = &metrics.last;
+    char buf[4096];
+    size_t len;
+    int fd, i;
+
+    while ((fd = accept4(loop.status_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        len = snprintf(buf, sizeof(buf),
+                       "version %d\n"
+                       "mode %s\n"
+                       "profile %s\n"
+                       "pwm_sink %s\n"
+                       "uptime_s %lld\n"
+                       "ticks %llu\n"
+                       "interval_ms %d\n"
+                       "tick_us %u\n"
+                       "tick_max_us %u\n"
+                       "temp_cpu %d\n"
+                       "temp_gpu %d\n",
+                       METRICS_VERSION, split_mode ? "split" : "unified",
+                       active_profile[0] ? active_profile : "none",
+                       pwm_sink.base[0] ? pwm_sink.base : "none",
+                       (now_ms() - metrics.started) / 1000,
+                       (unsigned long long)metrics.ticks, sched.interval,
+                       m->tick_us, timing.hist[PHASE_TICK].max_us, m->temp[0], m->temp[1]);
+        for (i = 0; i < 2 && len < sizeof(buf); i++)
+            len += snprintf(buf + len, sizeof(buf) - len, "fan%d %d %d %d\n", i + 1,
+                            m->target[i], m->commanded[i], m->current[i]);
+        for (i = 0; i < (int)m->nsensors && i < nsensors && len < sizeof(buf); i++)
+            len += snprintf(buf + len, sizeof(buf) - len, "sensor %s %s/%s %d\n",
+                            sensors[i].group == GROUP_CPU ? "cpu" : "gpu",
+                            sensor_infos[i].name, sensor_infos[i].label, m->sensor[i]);
+        if (len < sizeof(buf))
+            len += format_timing(buf + len, sizeof(buf) - len, "latency_");
+        if (len > sizeof(buf))
+            len = sizeof(buf);
+
+        /* A client that doesn't read right away just gets less */
+        send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+    }
 }
 
-static int exists(const char *path)
+/*
+ * Route signals through a signalfd and hwmon hotplug through a uevent
+ * socket, so the tick timer, kernel temperature events and both of these
+ * wake one epoll_wait(). Falls back to plain signal handlers if either
+ * fd can't be created.
+ */
+static void loop_init(void)
 {
-    return access(path, F_OK) == 0;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd >= 0 && sigprocmask(SIG_BLOCK, &mask, NULL) == 0) {
+        loop.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (loop.signal_fd < 0 || loop_add(loop.signal_fd, EPOLLIN) < 0)
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    }
+
+    if (loop.signal_fd < 0) {
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+        signal(SIGUSR1, signal_handler);
+    }
+
+    if (loop.epoll_fd < 0)
+        return;
+
+    loop.uevent_fd = open_uevent_socket();
+    if (loop_add(loop.uevent_fd, EPOLLIN) < 0 && loop.uevent_fd >= 0) {
+        close(loop.uevent_fd);
+        loop.uevent_fd = -1;
+    }
+    loop_add(sched.timer_fd, EPOLLIN);
+    loop_sync_ec_temp();
+
+    /* Profile switches go through sysfs_notify(), no need to read it per tick */
+    loop.profile_fd = open(PLATFORM_PROFILE_PATH, O_RDONLY | O_CLOEXEC);
+    if (loop_add(loop.profile_fd, EPOLLPRI | EPOLLERR) < 0 && loop.profile_fd >= 0) {
+        close(loop.profile_fd);
+        loop.profile_fd = -1;
+    }
+    update_profile();
+
+    loop.status_fd = open_status_socket();
+    if (loop_add(loop.status_fd, EPOLLIN) < 0 && loop.status_fd >= 0) {
+        close(loop.status_fd);
+        loop.status_fd = -1;
+        unlink(STATUS_SOCKET);
+    }
 }
 
-static int find_hwmon_by_name(const char *name, char *out, size_t len)
+/* Does the handle point into hwmon device dev ("hwmonN")? */
+static int path_in_hwmon(const char *path, const char *dev)
 {
-    DIR *dir;
-    struct dirent *ent;
-    char path[512];
-    char hwmon_name[128];
+    size_t base_len = strlen(hwmon_root);
+    size_t dev_len = strlen(dev);
 
-    dir = opendir(HWMON_BASE);
-    if (!dir)
-        return -1;
+    return strncmp(path, hwmon_root, base_len) == 0 && path[base_len] == '/' &&
+           strncmp(path + base_len + 1, dev, dev_len) == 0 &&
+           (path[base_len + 1 + dev_len] == '/' || path[base_len + 1 + dev_len] == '\0');
+}
 
-    while ((ent = readdir(dir)) != NULL) {
-        if (strncmp(ent->d_name, "hwmon", 5) != 0)
-            continue;
+/* The sink was replaced: take manual control of it again */
+static void resolve_pwm_sink(void)
+{
+    select_pwm_sink();
+    if (pwm_sink.base[0]) {
+        set_manual_mode();
+        open_event_source();
+    }
+    unified_fan.commanded = -1;
+    split_fans[0].commanded = -1;
+    split_fans[1].commanded = -1;
+    loop_sync_ec_temp();
+    log_event("PWM sink:", pwm_sink.base);
+}
 
-        snprintf(path, sizeof(path), "%s/%s/name", HWMON_BASE, ent->d_name);
-        if (sysfs_read_str(path, hwmon_name, sizeof(hwmon_name)) == 0) {
-            if (strcmp(hwmon_name, name) == 0) {
-                snprintf(out, len, "%s/%s", HWMON_BASE, ent->d_name);
-                closedir(dir);
-                return 0;
-            }
+/* Re-resolve only the sources that could be affected by dev coming or going */
+static int hwmon_changed(const char *dev, int added)
+{
+    struct hwmon_dev *d = NULL;
+    char msg[160], buf[16];
+    int changed = 0, group = -1, n;
+
+    /* Only this device is rescanned and only its sensors are touched */
+    n = sensors_remove_device(dev);
+    if (added) {
+        d = hwmon_index_add(dev);
+        if (!d)
+            return 0;
+        group = sensor_device_group(d->name);
+        if (group >= 0)
+            n = sensors_add_device(d, group);
+    } else {
+        hwmon_index_remove(dev);
+    }
+
+    if (n > 0) {
+        filter_reset(&cpu_filter);
+        filter_reset(&gpu_filter);
+        snprintf(msg, sizeof(msg), "%s %d sensor(s) of %s, now", added ? "added" : "removed", n, dev);
+        snprintf(buf, sizeof(buf), "%d", nsensors);
+        log_event(msg, buf);
+        changed = 1;
+    }
+
+    if ((added && (strcmp(d->name, "uniwill_ibg10_fanctl") == 0 || !pwm_sink.base[0])) ||
+        (!added && path_in_hwmon(pwm_sink.base, dev))) {
+        resolve_pwm_sink();
+        changed = 1;
+    }
+
+    return changed;
+}
+
+/* Drain the uevent socket, returns nonzero if any source was re-resolved */
+static int handle_uevents(void)
+{
+    char buf[4096];
+    struct sockaddr_nl addr;
+    socklen_t addr_len;
+    ssize_t n;
+    int changed = 0;
+
+    for (;;) {
+        const char *action = NULL, *devpath = NULL, *subsystem = NULL;
+        const char *p, *dev;
+
+        addr_len = sizeof(addr);
+        n = recvfrom(loop.uevent_fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, &addr_len);
+        if (n <= 0)
+            break;
+        if (addr.nl_pid != 0)
+            continue;   /* only trust the kernel */
+        buf[n] = '\0';
+
+        /* "action@devpath\0KEY=value\0KEY=value\0..." */
+        for (p = buf; p < buf + n; p += strlen(p) + 1) {
+            if (strncmp(p, "ACTION=", 7) == 0)
+                action = p + 7;
+            else if (strncmp(p, "DEVPATH=", 8) == 0)
+                devpath = p + 8;
+            else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+                subsystem = p + 10;
         }
+
+        if (!action || !devpath || !subsystem || strcmp(subsystem, "hwmon") != 0)
+            continue;
+
+        dev = strrchr(devpath, '/');
+        dev = dev ? dev + 1 : devpath;
+        if (strcmp(action, "add") == 0)
+            changed |= hwmon_changed(dev, 1);
+        else if (strcmp(action, "remove") == 0)
+            changed |= hwmon_changed(dev, 0);
     }
 
-    closedir(dir);
-    return -1;
+    return changed;
 }
 
-static int find_hwmon_with_pwm(char *out, size_t len)
+static void rescan_sources(void)
 {
-    DIR *dir;
-    struct dirent *ent;
-    char base[512];
-    char path[512];
-    int i;
+    char buf[16];
 
-    dir = opendir(HWMON_BASE);
-    if (!dir)
-        return -1;
+    hwmon_index_build();
+    select_temp_sources();
+    snprintf(buf, sizeof(buf), "%d", nsensors);
+    log_event("Sensors:", buf);
+    resolve_pwm_sink();
+}
 
-    while ((ent = readdir(dir)) != NULL) {
-        if (strncmp(ent->d_name, "hwmon", 5) != 0)
+static void handle_signals(void)
+{
+    struct signalfd_siginfo si;
+
+    while (read(loop.signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1) {
+            print_timing();
+            continue;
+        }
+        if (si.ssi_signo != SIGHUP) {
+            running = 0;
             continue;
+        }
+
+        /* Manual mode and the open handles are left alone */
+        if (reload_config() == 0)
+            log_event("Config reloaded:", config_path);
+        else
+            log_event("Config reload failed, keeping the current curve:", config_path);
 
-        snprintf(base, sizeof(base), "%s/%s", HWMON_BASE, ent->d_name);
-        for (i = 1; i <= 3; i++) {
-            int n = snprintf(path, sizeof(path), "%s/pwm%d", base, i);
-            if (n < 0 || n >= (int)sizeof(path))
-                continue;
-            if (is_writable(path)) {
-                n = snprintf(out, len, "%s", base);
-                if (n >= 0 && n < (int)len) {
-                    closedir(dir);
-                    return 0;
+        /* Without uevents this is the only way to pick up new devices */
+        if (loop.uevent_fd < 0)
+            rescan_sources();
+    }
+}
+
+/*
+ * Sleep until the next tick is due, the kernel reports a temperature
+ * change or a source was re-resolved after hotplug. Signals and uevents
+ * that don't need a new update are handled without ending the wait.
+ */
+static void wait_for_update(struct tick_sched *ts)
+{
+    struct epoll_event events[4];
+    uint64_t expirations;
+    char buf[16];
+    int timeout, n, i;
+
+    sched_arm(ts);
+
+    while (running) {
+        timeout = -1;
+        if (ts->timer_fd < 0) {
+            timeout = (int)(ts->deadline - now_ms());
+            if (timeout <= 0) {
+                timing_check_late(ts);
+                return;
+            }
+        }
+
+        if (loop.epoll_fd >= 0) {
+            n = epoll_wait(loop.epoll_fd, events, 4, timeout);
+        } else {
+            struct pollfd pfd = { .fd = ts->timer_fd, .events = POLLIN };
+            n = poll(&pfd, 1, timeout);
+            if (n > 0 && read(ts->timer_fd, &expirations, sizeof(expirations)) < 0)
+                expirations = 0;
+            if (n >= 0)
+                timing_check_late(ts);
+            return;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            timing_check_late(ts);
+        if (n <= 0)
+            return;
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == ts->timer_fd) {
+                if (read(fd, &expirations, sizeof(expirations)) < 0)
+                    expirations = 0;
+                timing_check_late(ts);
+                return;
+            } else if (fd == loop.signal_fd) {
+                handle_signals();
+            } else if (fd == loop.uevent_fd) {
+                if (handle_uevents()) {
+                    ts->deadline = now_ms() - ts->interval;
+                    return;
                 }
+            } else if (fd == loop.status_fd) {
+                handle_status();
+            } else if (fd == loop.profile_fd) {
+                if (update_profile()) {
+                    log_event("Profile:", active_profile);
+                    ts->deadline = now_ms() - ts->interval;
+                    return;
+                }
+            } else if (fd == loop.ec_temp_fd) {
+                /* sysfs poll is re-armed by reading the attribute again */
+                handle_read(&pwm_sink.ec_temp, buf, sizeof(buf));
+                loop_sync_ec_temp();
+                /* Woken early, start the next interval from now */
+                ts->deadline = now_ms() - ts->interval;
+                return;
             }
         }
     }
-
-    closedir(dir);
-    return -1;
 }
 
-static void build_pwm_paths(struct pwm_paths *pp, const char *base)
+/*
+ * The EC may have dropped manual mode and our speeds over suspend. Force the
+ * next tick to write and read back the pwm, and forget temperature history
+ * from before the sleep.
+ */
+static void handle_resume(void)
 {
-    snprintf(pp->base, sizeof(pp->base), "%s", base);
-    snprintf(pp->pwm1, sizeof(pp->pwm1), "%s/pwm1", base);
-    snprintf(pp->pwm1_enable, sizeof(pp->pwm1_enable), "%s/pwm1_enable", base);
-    snprintf(pp->pwm2, sizeof(pp->pwm2), "%s/pwm2", base);
-    snprintf(pp->pwm2_enable, sizeof(pp->pwm2_enable), "%s/pwm2_enable", base);
-    pp->has_pwm2 = exists(pp->pwm2) && exists(pp->pwm2_enable);
-}
-
-/* Get temperature in degrees C from temp1_input (millidegrees) */
-static int get_temp(const struct temp_paths *src)
-{
-    int temp = sysfs_read_int(src->temp);
-    if (temp < 0)
-        return -1;
-    return temp / 1000;
-}
-
-/* Linear interpolation for smooth fan curve */
-static int interpolate_speed(int temp)
-{
-    int range, pos;
-
-    if (temp <= TEMP_SILENT) {
-        return SPEED_MIN;
-    } else if (temp <= TEMP_LOW) {
-        range = TEMP_LOW - TEMP_SILENT;
-        pos = temp - TEMP_SILENT;
-        return SPEED_MIN + (SPEED_LOW - SPEED_MIN) * pos / range;
-    } else if (temp <= TEMP_MED) {
-        range = TEMP_MED - TEMP_LOW;
-        pos = temp - TEMP_LOW;
-        return SPEED_LOW + (SPEED_MED - SPEED_LOW) * pos / range;
-    } else if (temp <= TEMP_HIGH) {
-        range = TEMP_HIGH - TEMP_MED;
-        pos = temp - TEMP_MED;
-        return SPEED_MED + (SPEED_HIGH - SPEED_MED) * pos / range;
-    } else if (temp <= TEMP_MAX) {
-        range = TEMP_MAX - TEMP_HIGH;
-        pos = temp - TEMP_HIGH;
-        return SPEED_HIGH + (SPEED_MAX - SPEED_HIGH) * pos / range;
-    } else {
-        return SPEED_MAX;
+    int i;
+
+    log_event("Resumed from suspend,", "re-asserting the fan targets");
+    set_manual_mode();
+
+    unified_fan.commanded = -1;
+    unified_fan.last_readback = 0;
+    for (i = 0; i < 2; i++) {
+        split_fans[i].commanded = -1;
+        split_fans[i].last_readback = 0;
     }
+    filter_reset(&cpu_filter);
+    filter_reset(&gpu_filter);
 }
 
-static int calc_target(int temp, struct fan_state *fan)
+static void restore_auto(void)
 {
-    int target = interpolate_speed(temp);
+    if (pwm_sink.pwm1_enable.path[0])
+        handle_write_int(&pwm_sink.pwm1_enable, 2);
+    if (pwm_sink.has_pwm2)
+        handle_write_int(&pwm_sink.pwm2_enable, 2);
+}
 
-    if (target < fan->current) {
-        int cooler_target = interpolate_speed(temp + HYSTERESIS);
-        if (cooler_target >= fan->current)
-            target = fan->current;
+/*
+ * Split mode: each fan follows its own sensor, pulled towards the other one
+ * by the coupling factor when that is hotter (shared heatpipe). The load
+ * boost goes to the CPU fan only. Returns the
+ * tick interval the fans ask for.
+ */
+static int update_split(int cpu_t, int gpu_t, int boost, int targets[2])
+{
+    struct sysfs_handle *pwm[2] = {&pwm_sink.pwm1, &pwm_sink.pwm2};
+    int temps[2];
+    int interval = TICK_IDLE_MAX;
+    int i, n, temp;
+
+    temps[0] = cpu_t >= 0 ? cpu_t : gpu_t;
+    temps[1] = gpu_t >= 0 ? gpu_t : cpu_t;
+    if (temps[0] < 0)
+        temps[0] = temps[1] = 0;
+
+    for (i = 0; i < 2; i++) {
+        temp = temps[i];
+        if (temps[!i] > temp)
+            temp += (temps[!i] - temp) * config->coupling / 100;
+
+        update_current(&split_fans[i], pwm[i], NULL);
+        /* CPU load only heats the CPU side */
+        targets[i] = fan_control(&curves->fan[i], &split_fans[i], temp, i == 0 ? boost : 0);
+        set_fan_target(&split_fans[i], pwm[i], targets[i]);
+
+        n = fan_next_interval(&sched, &curves->fan[i], &split_fans[i], temp, targets[i]);
+        if (n < interval)
+            interval = n;
     }
 
-    return target;
+    return interval;
 }
 
-static const char *get_trend(int target, int *prev_target)
+/* Unified mode: both fans follow the hotter sensor. Returns the tick interval */
+static int update_unified(int cpu_t, int gpu_t, int boost, int targets[2])
 {
-    const char *trend;
+    int temp;
 
-    if (*prev_target < 0)
-        trend = " ";
-    else if (target > *prev_target)
-        trend = "^";
-    else if (target < *prev_target)
-        trend = "v";
+    if (cpu_t < 0 && gpu_t < 0)
+        temp = 0;
+    else if (cpu_t < 0)
+        temp = gpu_t;
+    else if (gpu_t < 0)
+        temp = cpu_t;
     else
-        trend = "=";
+        temp = (cpu_t > gpu_t) ? cpu_t : gpu_t;
 
-    *prev_target = target;
-    return trend;
+    update_current(&unified_fan, &pwm_sink.pwm1, pwm_sink.has_pwm2 ? &pwm_sink.pwm2 : NULL);
+    targets[0] = targets[1] = fan_control(&curves->unified, &unified_fan, temp, boost);
+
+    set_unified_target(&unified_fan, targets[0]);
+    return fan_next_interval(&sched, &curves->unified, &unified_fan, temp, targets[0]);
 }
 
-static void usage(const char *prog)
+/* How one fan moved over a trace, as recorded or as replayed */
+struct replay_stats {
+    long long writes;       /* pwm changes */
+    long long reversals;    /* changes against the direction of the previous one */
+    long long travel;       /* sum of all pwm changes */
+    long long loud_ms;      /* at or above REPLAY_LOUD_PWM */
+    double pwm_ms;          /* pwm integrated over time, for the mean */
+    int max;
+    int prev;               /* pwm of the previous tick, -1 if none */
+    int dir;                /* sign of the previous change */
+};
+
+/* Account one tick at pwm (-1 if unknown) that lasted dt ms */
+static void replay_account(struct replay_stats *rs, int pwm, long long dt)
 {
-    printf("Usage: %s [-h]\n", prog);
-    printf("\n");
-    printf("Silent fan control for TUXEDO InfinityBook Gen10 (hwmon)\n");
-    printf("\n");
-    printf("Options:\n");
-    printf("  -h    Show this help message\n");
+    int dir;
+
+    if (pwm < 0)
+        return;
+
+    if (rs->prev >= 0 && pwm != rs->prev) {
+        dir = pwm > rs->prev ? 1 : -1;
+        rs->writes++;
+        rs->travel += abs(pwm - rs->prev);
+        if (rs->dir && dir != rs->dir)
+            rs->reversals++;
+        rs->dir = dir;
+    }
+    rs->prev = pwm;
+    rs->pwm_ms += (double)pwm * dt;
+    if (pwm >= REPLAY_LOUD_PWM)
+        rs->loud_ms += dt;
+    if (pwm > rs->max)
+        rs->max = pwm;
 }
 
-static int select_temp_sources(void)
+static void print_replay_fan(const char *fan, const struct replay_stats rs[2], long long duration)
 {
-    char base[384];
-
-    /* CPU temp: prefer uniwill (if it exposes CPU temp), else k10temp */
-    if (find_hwmon_by_name("uniwill", base, sizeof(base)) == 0)
-        snprintf(cpu_temp_src.temp, sizeof(cpu_temp_src.temp), "%s/temp1_input", base);
-    else if (find_hwmon_by_name("k10temp", base, sizeof(base)) == 0)
-        snprintf(cpu_temp_src.temp, sizeof(cpu_temp_src.temp), "%s/temp1_input", base);
-    else
-        cpu_temp_src.temp[0] = '\0';
-
-    /* GPU temp: amdgpu */
-    if (find_hwmon_by_name("amdgpu", base, sizeof(base)) == 0)
-        snprintf(gpu_temp_src.temp, sizeof(gpu_temp_src.temp), "%s/temp1_input", base);
-    else
-        gpu_temp_src.temp[0] = '\0';
+    char label[32];
+
+    if (duration <= 0)
+        duration = 1;
+
+    snprintf(label, sizeof(label), "%s writes", fan);
+    printf("  %-20s %10lld %10lld\n", label, rs[0].writes, rs[1].writes);
+    snprintf(label, sizeof(label), "%s reversals", fan);
+    printf("  %-20s %10lld %10lld\n", label, rs[0].reversals, rs[1].reversals);
+    snprintf(label, sizeof(label), "%s travel (pwm)", fan);
+    printf("  %-20s %10lld %10lld\n", label, rs[0].travel, rs[1].travel);
+    snprintf(label, sizeof(label), "%s mean (%%)", fan);
+    printf("  %-20s %10.1f %10.1f\n", label, rs[0].pwm_ms * 100 / 255 / duration,
+           rs[1].pwm_ms * 100 / 255 / duration);
+    snprintf(label, sizeof(label), "%s max (%%)", fan);
+    printf("  %-20s %10.1f %10.1f\n", label, rs[0].max * 100.0 / 255, rs[1].max * 100.0 / 255);
+    snprintf(label, sizeof(label), "%s >= %d%% (s)", fan, REPLAY_LOUD_PWM * 100 / 255);
+    printf("  %-20s %10.1f %10.1f\n", label, rs[0].loud_ms / 1000.0, rs[1].loud_ms / 1000.0);
+}
 
-    /* Fallback: if both empty, try uniwill as EC temp */
-    if (!cpu_temp_src.temp[0] && !gpu_temp_src.temp[0]) {
-        if (find_hwmon_by_name("uniwill", base, sizeof(base)) == 0)
-            snprintf(cpu_temp_src.temp, sizeof(cpu_temp_src.temp), "%s/temp1_input", base);
+/*
+ * --replay: run a recorded trace through the configured sensor weights,
+ * filter, controllers and slew limits as fast as possible, with the
+ * record times as the clock and a sink that takes every write. Nothing is
+ * read from sysfs. The temperatures are the recorded ones, so this shows
+ * what the fans would have done, not how the laptop would have reacted.
+ */
+static int replay_trace(const char *path)
+{
+    const struct trace_header *hdr;
+    const struct trace_record *rec, *r;
+    struct replay_stats stats[2][2];    /* fan, recorded/replayed */
+    long long hot_ms[2][2] = {{0, 0}, {0, 0}};  /* group, raw/filtered */
+    struct fan_state *fan[2];
+    struct stat st;
+    size_t nrec, i;
+    long long dt, duration, elapsed;
+    int raw[2], temps[2], targets[2];
+    int fd, j, g, boost;
+    char label[32];
+    void *map;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "Error: %s is not a trace\n", path);
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s: %s\n", path, strerror(errno));
+        return 1;
     }
 
-    return (cpu_temp_src.temp[0] || gpu_temp_src.temp[0]) ? 0 : -1;
-}
+    hdr = map;
+    if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+        hdr->record_size != sizeof(struct trace_record) || hdr->nslots > SENSOR_MAX) {
+        fprintf(stderr, "Error: %s is not a version %d trace\n", path, TRACE_VERSION);
+        munmap(map, st.st_size);
+        return 1;
+    }
+    rec = (const struct trace_record *)(hdr + 1);
+    nrec = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+    if (!nrec) {
+        fprintf(stderr, "Error: %s has no records\n", path);
+        munmap(map, st.st_size);
+        return 1;
+    }
 
-static int select_pwm_sink(void)
-{
-    char base[384];
+    /* The recorded sensors stand in for hwmon, weighed by this config */
+    nsensors = hdr->nslots;
+    for (j = 0; j < nsensors; j++) {
+        sensors[j].fd = -1;
+        sensors[j].hwmon = hdr->sensor[j].hwmon;
+        sensors[j].channel = hdr->sensor[j].channel;
+        sensors[j].group = hdr->sensor[j].group == GROUP_GPU ? GROUP_GPU : GROUP_CPU;
+        snprintf(sensor_infos[j].name, sizeof(sensor_infos[j].name), "%.*s",
+                 (int)sizeof(hdr->sensor[j].name) - 1, hdr->sensor[j].name);
+        snprintf(sensor_infos[j].label, sizeof(sensor_infos[j].label), "%.*s",
+                 (int)sizeof(hdr->sensor[j].label) - 1, hdr->sensor[j].label);
+        sensor_apply_rules(j);
+    }
 
-    /* Prefer our standalone hwmon device name */
-    if (find_hwmon_by_name("uniwill_ibg10_fanctl", base, sizeof(base)) == 0) {
-        build_pwm_paths(&pwm_sink, base);
-        return 0;
+    /* The simulated EC starts out where the recorded one was */
+    fan[0] = split_mode ? &split_fans[0] : &unified_fan;
+    fan[1] = split_mode ? &split_fans[1] : &unified_fan;
+    for (j = 0; j < 2; j++) {
+        fan[j]->commanded = rec[0].pwm[j] >= 0 ? rec[0].pwm[j] : 0;
+        fan[j]->current = fan[j]->commanded;
     }
+    memset(stats, 0, sizeof(stats));
+    for (j = 0; j < 2; j++)
+        stats[j][0].prev = stats[j][1].prev = -1;
+
+    elapsed = now_us();
+    for (i = 0; i < nrec; i++) {
+        r = &rec[i];
+        dt = i + 1 < nrec ? rec[i + 1].time_ms - r->time_ms : 0;
+        if (dt < 0)
+            dt = 0;
+        replay_clock = r->time_ms > 0 ? r->time_ms : 1;
+
+        raw[GROUP_CPU] = raw[GROUP_GPU] = -1;
+        for (j = 0; j < nsensors; j++) {
+            sensors[j].raw = sensors[j].value = METRICS_NONE;
+            if (r->sensor[j] != METRICS_NONE && sensors[j].weight)
+                sensor_weigh(&sensors[j], r->sensor[j], raw);
+        }
+        temps[GROUP_CPU] = get_temp(&cpu_filter, raw[GROUP_CPU]);
+        temps[GROUP_GPU] = get_temp(&gpu_filter, raw[GROUP_GPU]);
+        boost = load_boost(&cpu_load, r->load);
 
-    /* Otherwise any writable hwmon with pwm1 */
-    if (find_hwmon_with_pwm(base, sizeof(base)) == 0) {
-        build_pwm_paths(&pwm_sink, base);
-        return 0;
+        if (split_mode)
+            update_split(predict_temp(&cpu_filter, temps[GROUP_CPU]), predict_temp(&gpu_filter, temps[GROUP_GPU]),
+                         boost, targets);
+        else
+            update_unified(predict_temp(&cpu_filter, temps[GROUP_CPU]), predict_temp(&gpu_filter, temps[GROUP_GPU]),
+                           boost, targets);
+
+        for (g = 0; g < 2; g++) {
+            if (raw[g] >= REPLAY_HOT_TEMP * 1000)
+                hot_ms[g][0] += dt;
+            if (temps[g] >= REPLAY_HOT_TEMP)
+                hot_ms[g][1] += dt;
+        }
+        for (j = 0; j < 2; j++) {
+            replay_account(&stats[j][0], r->pwm[j], dt);
+            replay_account(&stats[j][1], fan[j]->commanded, dt);
+        }
+    }
+    elapsed = now_us() - elapsed;
+    replay_clock = 0;
+    duration = rec[nrec - 1].time_ms - rec[0].time_ms;
+
+    printf("Replayed %zu ticks (%lld:%02lld:%02lld of %s) in %.1f ms, %.2f us per tick\n", nrec,
+           duration / 3600000, duration / 60000 % 60, duration / 1000 % 60, path,
+           elapsed / 1000.0, (double)elapsed / nrec);
+    printf("  Mode: %s, recorded %s\n", split_mode ? "split" : "unified", hdr->split ? "split" : "unified");
+    printf("\n  %-20s %10s %10s\n", "", "recorded", "replayed");
+    if (split_mode || hdr->split) {
+        print_replay_fan("fan1", stats[0], duration);
+        print_replay_fan("fan2", stats[1], duration);
+    } else {
+        print_replay_fan("fan", stats[0], duration);
+    }
+    printf("\n  %-20s %10s %10s\n", "", "raw", "filtered");
+    for (g = 0; g < 2; g++) {
+        snprintf(label, sizeof(label), "%s >= %d C (s)", g == GROUP_CPU ? "cpu" : "gpu", REPLAY_HOT_TEMP);
+        printf("  %-20s %10.1f %10.1f\n", label, hot_ms[g][0] / 1000.0, hot_ms[g][1] / 1000.0);
     }
 
-    return -1;
+    munmap(map, st.st_size);
+    return 0;
 }
 
-static void print_banner(void)
+/*
+ * One pass of the control loop: read the sensors, filter, run the
+ * controllers, write the pwm and publish the tick. Fills the filtered
+ * temperatures and the targets, returns the interval the fans ask for.
+ */
+static int run_tick(int *cpu_t, int *gpu_t, int targets[2])
 {
-    printf("\n");
-    printf("  TUXEDO InfinityBook Gen10 Silent Fan Control (hwmon)\n");
-    printf("  ----------------------------------------------------\n");
-    printf("  Fan off:    < %d C\n", TEMP_SILENT);
-    printf("  Low speed:  %d-%d C\n", TEMP_SILENT, TEMP_LOW);
-    printf("  Med speed:  %d-%d C\n", TEMP_LOW, TEMP_MED);
-    printf("  High speed: %d-%d C\n", TEMP_MED, TEMP_HIGH);
-    printf("  Max speed:  > %d C\n", TEMP_MAX);
-    printf("\n");
-    printf("  Temp source (CPU): %s\n", cpu_temp_src.temp[0] ? cpu_temp_src.temp : "none");
-    printf("  Temp source (GPU): %s\n", gpu_temp_src.temp[0] ? gpu_temp_src.temp : "none");
-    printf("  PWM sink:          %s\n", pwm_sink.base[0] ? pwm_sink.base : "none");
-    printf("  Mode: Unified (both fans follow max temp - shared heatpipes)\n");
-    printf("\n");
-    printf("  Trend: ^ = ramping up, v = slowing down, = = steady\n");
-    printf("  Ctrl+C to stop and restore automatic control\n");
-    printf("\n");
-    printf("Time     | CPU | GPU | Fan\n");
-    printf("---------|-----|-----|-------\n");
+    int raw[2], cpu_in, gpu_in, load, boost, interval;
+
+    timing_start();
+    sensors_read(raw);
+    timing_add(PHASE_SENSORS, timing.start);
+    *cpu_t = get_temp(&cpu_filter, raw[GROUP_CPU]);
+    *gpu_t = get_temp(&gpu_filter, raw[GROUP_GPU]);
+    cpu_in = predict_temp(&cpu_filter, *cpu_t);
+    gpu_in = predict_temp(&gpu_filter, *gpu_t);
+    load = load_sample(&cpu_load);
+    boost = load_boost(&cpu_load, load);
+
+    if (split_mode)
+        interval = update_split(cpu_in, gpu_in, boost, targets);
+    else
+        interval = update_unified(cpu_in, gpu_in, boost, targets);
+
+    timing_end(interval);
+    metrics_publish(*cpu_t, *gpu_t, targets);
+    trace_write(load);
+    return interval;
 }
 
-static int set_manual_mode(void)
+static void print_bench(const char *what, const struct latency_hist *h)
 {
-    /* 1 = manual, 2 = auto */
-    int ret = 0;
+    printf("  %-12s %8llu %8u %8u %8u\n", what, (unsigned long long)h->count, hist_percentile(h, 50),
+           hist_percentile(h, 99), h->max_us);
+}
+
+/*
+ * --bench: once the sources are set up, time BENCH_RUNS more discovery
+ * passes, the given number of back-to-back ticks and BENCH_RUNS config
+ * reloads. Meant for a synthetic tree given with --hwmon-root; on the
+ * laptop the ticks write the real fans.
+ */
+static void run_bench(int ticks, uint32_t startup_us)
+{
+    struct latency_hist discovery, reload;
+    long long start, elapsed;
+    int cpu_t, gpu_t, targets[2], done, i;
+
+    memset(&discovery, 0, sizeof(discovery));
+    memset(&reload, 0, sizeof(reload));
+    printf("Bench: %s, %d devices, %d sensors, PWM sink %s\n", hwmon_root, nhwmon, nsensors, pwm_sink.base);
+    printf("  startup discovery %u us\n\n", startup_us);
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        start = now_us();
+        hwmon_index_build();
+        select_temp_sources();
+        select_pwm_sink();
+        hist_add(&discovery, now_us() - start);
+    }
 
-    if (pwm_sink.pwm1_enable[0])
-        ret |= sysfs_write_int(pwm_sink.pwm1_enable, 1);
-    if (pwm_sink.has_pwm2 && pwm_sink.pwm2_enable[0])
-        ret |= sysfs_write_int(pwm_sink.pwm2_enable, 1);
+    start = now_us();
+    for (done = 0; done < ticks && running; done++)
+        run_tick(&cpu_t, &gpu_t, targets);
+    elapsed = now_us() - start;
 
-    return ret;
+    for (i = 0; i < BENCH_RUNS; i++) {
+        start = now_us();
+        reload_config();
+        hist_add(&reload, now_us() - start);
+    }
+
+    printf("  %-12s %8s %8s %8s %8s (us)\n", "", "count", "p50", "p99", "max");
+    print_bench("discovery", &discovery);
+    print_bench("reload", &reload);
+    printf("\n%d ticks in %lld us, %.2f us per tick\n", done, elapsed, done ? (double)elapsed / done : 0);
+    print_timing();
 }
 
-static void restore_auto(void)
+/* Strip trailing slashes, path_in_hwmon() compares against the plain root */
+static void set_hwmon_root(const char *dir)
 {
-    if (pwm_sink.pwm1_enable[0])
-        sysfs_write_int(pwm_sink.pwm1_enable, 2);
-    if (pwm_sink.has_pwm2 && pwm_sink.pwm2_enable[0])
-        sysfs_write_int(pwm_sink.pwm2_enable, 2);
+    static char root[256];
+    size_t len;
+
+    snprintf(root, sizeof(root), "%s", dir);
+    len = strlen(root);
+    while (len > 1 && root[len - 1] == '/')
+        root[--len] = '\0';
+    hwmon_root = root;
 }
 
 int main(int argc, char *argv[])
 {
-    int temp;
-    int target;
-    int fan_actual1, fan_actual2;
-    int fan_actual_avg;
+    static const struct option long_options[] = {
+        {"config", required_argument, NULL, 'c'},
+        {"split", no_argument, NULL, 's'},
+        {"record", required_argument, NULL, 'r'},
+        {"replay", required_argument, NULL, 'R'},
+        {"hwmon-root", required_argument, NULL, 'H'},
+        {"bench", required_argument, NULL, 'b'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *replay_path = NULL;
+    int targets[2] = {0, 0};
+    int cpu_t, gpu_t, interval, bench_ticks = 0;
+    long long slept, n, start;
     time_t now;
     struct tm *tm_info;
-    struct timespec ts;
     char time_buf[16];
     int opt;
 
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    if (getenv(HWMON_ROOT_ENV) && getenv(HWMON_ROOT_ENV)[0])
+        set_hwmon_root(getenv(HWMON_ROOT_ENV));
+
+    while ((opt = getopt_long(argc, argv, "c:sr:R:H:b:h", long_options, NULL)) != -1) {
         switch (opt) {
+        case 'c':
+            config_path = optarg;
+            config_required = 1;
+            break;
+        case 's':
+            split_mode = 1;
+            break;
+        case 'r':
+            record_path = optarg;
+            break;
+        case 'R':
+            replay_path = optarg;
+            break;
+        case 'H':
+            set_hwmon_root(optarg);
+            break;
+        case 'b':
+            if (parse_config_int(optarg, 1, INT32_MAX, &bench_ticks) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -398,15 +3298,40 @@ int main(int argc, char *argv[])
         }
     }
 
+    if ((record_path || bench_ticks) && replay_path) {
+        usage(argv[0]);
+        return 1;
+    }
+
     interactive = isatty(STDOUT_FILENO);
 
+    if (reload_config() < 0)
+        return 1;
+
+    if (replay_path)
+        return replay_trace(replay_path);
+
+    start = now_us();
+    hwmon_index_build();
+
     if (select_temp_sources() < 0) {
-        fprintf(stderr, "Error: no temperature sensor (uniwill/k10temp/amdgpu) found under %s\n", HWMON_BASE);
+        fprintf(stderr, "Error: no temperature sensor (k10temp/uniwill/nvme/amdgpu) found under %s\n", hwmon_root);
         return 1;
     }
 
     if (select_pwm_sink() < 0) {
-        fprintf(stderr, "Error: no writable PWM device found under %s (expected uniwill_ibg10_fanctl)\n", HWMON_BASE);
+        fprintf(stderr, "Error: no writable PWM device found under %s (expected uniwill_ibg10_fanctl)\n", hwmon_root);
+        return 1;
+    }
+    start = now_us() - start;
+
+    if (split_mode && !pwm_sink.has_pwm2) {
+        fprintf(stderr, "Error: --split needs pwm1 and pwm2 on %s\n", pwm_sink.base);
+        return 1;
+    }
+
+    if (record_path && trace_open(record_path) < 0) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", record_path, strerror(errno));
         return 1;
     }
 
@@ -415,8 +3340,21 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    open_event_source();
+    sched_init(&sched);
+
+    /* Leave the metrics, status socket and signals of a running daemon alone */
+    if (bench_ticks) {
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+        run_bench(bench_ticks, (uint32_t)start);
+        restore_auto();
+        trace_close();
+        return 0;
+    }
+
+    metrics_init();
+    loop_init();
 
     if (interactive) {
         print_banner();
@@ -425,33 +3363,10 @@ int main(int argc, char *argv[])
         printf("Starting fan control daemon...\n");
     }
 
-    while (running) {
-        int cpu_t = cpu_temp_src.temp[0] ? get_temp(&cpu_temp_src) : -1;
-        int gpu_t = gpu_temp_src.temp[0] ? get_temp(&gpu_temp_src) : -1;
-
-        if (cpu_t < 0 && gpu_t < 0)
-            temp = 0;
-        else if (cpu_t < 0)
-            temp = gpu_t;
-        else if (gpu_t < 0)
-            temp = cpu_t;
-        else
-            temp = (cpu_t > gpu_t) ? cpu_t : gpu_t;
-
-        fan_actual1 = sysfs_read_int(pwm_sink.pwm1);
-        if (fan_actual1 < 0)
-            fan_actual1 = 0;
-        fan_actual2 = pwm_sink.has_pwm2 ? sysfs_read_int(pwm_sink.pwm2) : fan_actual1;
-        if (fan_actual2 < 0)
-            fan_actual2 = fan_actual1;
+    slept = suspended_ms();
 
-        fan_actual_avg = (fan_actual1 + fan_actual2) / 2;
-        unified_fan.current = fan_actual_avg;
-        target = calc_target(temp, &unified_fan);
-
-        sysfs_write_int(pwm_sink.pwm1, target);
-        if (pwm_sink.has_pwm2)
-            sysfs_write_int(pwm_sink.pwm2, target);
+    while (running) {
+        interval = run_tick(&cpu_t, &gpu_t, targets);
 
         if (interactive) {
             now = time(NULL);
@@ -459,20 +3374,42 @@ int main(int argc, char *argv[])
             strftime(time_buf, sizeof(time_buf), "%H:%M:%S", tm_info);
 
             printf("\033[1A");
-            printf("%s | %3d | %3d | %3d%% %s\n",
-                   time_buf,
-                   cpu_t >= 0 ? cpu_t : 0,
-                   gpu_t >= 0 ? gpu_t : 0,
-                   target * 100 / 255,
-                   get_trend(target, &unified_fan.prev_target));
+            if (split_mode)
+                printf("%s | %3d | %3d | %3d%% %s  | %3d%% %s\n",
+                       time_buf,
+                       cpu_t >= 0 ? cpu_t : 0,
+                       gpu_t >= 0 ? gpu_t : 0,
+                       targets[0] * 100 / 255,
+                       get_trend(targets[0], &split_fans[0].prev_target),
+                       targets[1] * 100 / 255,
+                       get_trend(targets[1], &split_fans[1].prev_target));
+            else
+                printf("%s | %3d | %3d | %3d%% %s\n",
+                       time_buf,
+                       cpu_t >= 0 ? cpu_t : 0,
+                       gpu_t >= 0 ? gpu_t : 0,
+                       targets[0] * 100 / 255,
+                       get_trend(targets[0], &unified_fan.prev_target));
             fflush(stdout);
         }
 
-        ts.tv_nsec = 0;
-        ts.tv_sec = POLL_INTERVAL;
-        nanosleep(&ts, NULL);
+        sched_update(&sched, interval);
+        wait_for_update(&sched);
+
+        n = suspended_ms();
+        if (n - slept >= RESUME_MIN_SLEEP)
+            handle_resume();
+        slept = n;
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_timing();
+        }
     }
 
     restore_auto();
+    print_timing();
+    metrics_close();
+    trace_close();
     return 0;
 }
@@ -10,17 +10,29 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/acpi.h>
+#include <linux/atomic.h>
 #include <linux/bitops.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/fs.h>
 #include <linux/hwmon.h>
 #include <linux/hwmon-sysfs.h>
 #include <linux/init.h>
+#include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
 #include <linux/wmi.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include "uniwill_ibg10_fanctl_trace.h"
 
 MODULE_DESCRIPTION("Fan control for TUXEDO InfinityBook Pro AMD Gen10");
 MODULE_AUTHOR("Timo Hubois");
@@ -31,6 +43,44 @@ MODULE_LICENSE("GPL");
 #define UNIWILL_WMI_MGMT_GUID_BC "ABBC0F6F-8EA1-11D1-00A0-C90629100000"
 MODULE_ALIAS("wmi:" UNIWILL_WMI_MGMT_GUID_BC);
 
+static unsigned int cache_ms = 250;
+module_param(cache_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ms, "Serve temp/pwm reads from cache for this many ms (0 = always read EC)");
+
+#define UW_WRITE_MAX_ATTEMPTS  16
+
+static unsigned int write_retries = 5;
+module_param(write_retries, uint, 0644);
+MODULE_PARM_DESC(write_retries, "Max attempts until the EC accepts a fan speed (1-16)");
+
+static unsigned int write_delay_ms = 10;
+module_param(write_delay_ms, uint, 0644);
+MODULE_PARM_DESC(write_delay_ms, "Delay between fan speed write attempts in ms");
+
+static bool async_write;
+module_param(async_write, bool, 0644);
+MODULE_PARM_DESC(async_write, "Apply pwm writes from a work item instead of waiting for the EC");
+
+static bool init_on_load;
+module_param(init_on_load, bool, 0444);
+MODULE_PARM_DESC(init_on_load, "Set up manual fan control in the background at load time");
+
+static unsigned int curve_interval_ms = 1000;
+module_param(curve_interval_ms, uint, 0644);
+MODULE_PARM_DESC(curve_interval_ms, "Update interval of the in-kernel fan curve in ms (min 100)");
+
+static unsigned int curve_hysteresis = 6;
+module_param(curve_hysteresis, uint, 0644);
+MODULE_PARM_DESC(curve_hysteresis, "Degrees C the temperature must drop before the fan curve slows down");
+
+static unsigned int temp_sample_ms = 4000;
+module_param(temp_sample_ms, uint, 0644);
+MODULE_PARM_DESC(temp_sample_ms, "Interval for sampling the EC temperature for poll() notifications in ms, each sample is a WMI call and a wakeup (min 100, 0 = off)");
+
+static unsigned int temp_notify_delta = 2;
+module_param(temp_notify_delta, uint, 0644);
+MODULE_PARM_DESC(temp_notify_delta, "Notify temp1_input pollers once the temperature moved this many degrees C (0 = only on alarm changes)");
+
 /* EC addresses for custom fan table control */
 #define UW_EC_REG_USE_CUSTOM_FAN_TABLE_0    0x07c5
 #define UW_EC_REG_USE_CUSTOM_FAN_TABLE_1    0x07c6
@@ -64,220 +114,1212 @@ MODULE_ALIAS("wmi:" UNIWILL_WMI_MGMT_GUID_BC);
 #define FAN_SPEED_MAX          200  /* EC scale */
 #define FAN_ON_MIN_SPEED       25   /* ~12.5% to avoid EC fighting */
 
+/* pwmN_enable values */
+#define IBG10_PWM_MANUAL       1
+#define IBG10_PWM_AUTO         2    /* EC firmware control */
+#define IBG10_PWM_EC_CURVE     3    /* fan curve run by the EC from its fan table */
+#define IBG10_PWM_CURVE        5    /* in-kernel fan curve */
+
+#define IBG10_CURVE_POINTS     5
+#define IBG10_CURVE_TEMP_MAX   120000
+#define IBG10_CURVE_ZONE_STEPS 3    /* EC zones per curve segment */
+
+#define IBG10_TEMP_MAX_DEFAULT  92000
+#define IBG10_TEMP_CRIT_DEFAULT 100000
+#define IBG10_TEMP_IDLE_MS      10000 /* keep sampling this long after a temp read */
+
+/* Piecewise-linear curve, temp in millidegree C, pwm on the 0-255 hwmon scale */
+struct ibg10_curve {
+	long temp[IBG10_CURVE_POINTS];
+	long pwm[IBG10_CURVE_POINTS];
+};
+
+/* Same silent curve as the userspace daemon */
+static const struct ibg10_curve ibg10_default_curve = {
+	.temp = { 62000, 70000, 78000, 86000, 92000 },
+	.pwm = { 32, 64, 128, 192, 255 },
+};
+
+/* Full custom fan table (CPU + GPU): 0x0f00-0x0f5f */
+#define UW_EC_FAN_TABLE_BASE   UW_EC_REG_CPU_FAN_TABLE_END_TEMP
+#define UW_EC_FAN_TABLE_LEN    0x60
+#define UW_EC_FAN_TABLE_ZONES  16
+#define UW_FAN_TABLE_IDX(reg)  ((reg) - UW_EC_FAN_TABLE_BASE)
+
+/*
+ * Registers outside the fan table that are mirrored in the shadow cache.
+ * Their slots follow the fan table slots. The temperature is never written,
+ * its slot only serves the read cache.
+ */
+static const u16 uw_shadow_regs[] = {
+	UW_EC_REG_FAN1_TEMP,
+	UW_EC_REG_USE_CUSTOM_FAN_TABLE_0,
+	UW_EC_REG_USE_CUSTOM_FAN_TABLE_1,
+	UW_EC_REG_CUSTOM_PROFILE,
+	UW_EC_REG_MANUAL_MODE,
+	UW_EC_REG_FAN_MODE,
+	UW_EC_REG_FAN1_SPEED,
+	UW_EC_REG_FAN2_SPEED,
+};
+
+#define UW_SHADOW_SIZE         (UW_EC_FAN_TABLE_LEN + ARRAY_SIZE(uw_shadow_regs))
+
+#define UW_WMI_HIST_BUCKETS    20   /* bucket n counts calls under 2^n us */
+#define UW_WMI_OUT_SIZE        128  /* result object plus its buffer */
+#define UW_EC_ADDR_SPACE       0x10000
+
+/*
+ * EC traffic counters for debugfs, protected by ec_lock. Per-register
+ * counts use the shadow slots, with one more slot for all other registers.
+ */
+struct uw_ec_stats {
+	u32 reads[UW_SHADOW_SIZE + 1];
+	u32 writes[UW_SHADOW_SIZE + 1];
+	u32 read_failures;
+	u32 write_retries;
+	u32 write_failures;
+
+	/* wmi_evaluate_method() latency */
+	u64 wmi_calls;
+	u64 wmi_ns;
+	u64 wmi_max_ns;
+	u32 wmi_hist[UW_WMI_HIST_BUCKETS];
+
+	/* ec_lock use */
+	u64 lock_acquired;
+	u64 lock_contended;	/* had to wait for another holder */
+	u64 lock_wait_ns;
+	u64 lock_held_ns;
+	u64 lock_stamp;		/* when the current holder got it */
+};
+
 struct ibg10_data {
 	struct platform_device *pdev;
 	struct device *hwmon_dev;
 	bool fans_initialized;
+	struct mutex fan_lock;	/* serializes fan mode and speed changes */
 	struct mutex ec_lock;
+
+	/* Latest requested speeds for async_write, applied by pwm_work */
+	spinlock_t pending_lock;
+	u8 pending_speed[2];
+	unsigned long pending;
+	struct work_struct pwm_work;
+
+	struct work_struct init_work;
+	struct work_struct resume_work;
+
+	/* In-kernel fan curve, protected by fan_lock */
+	struct ibg10_curve curve[2];
+	int curve_pwm[2];		/* last applied pwm, -1 if none */
+	unsigned long curve_channels;	/* channels in IBG10_PWM_CURVE mode */
+	struct delayed_work curve_work;
+	bool ec_curve;			/* both fans in IBG10_PWM_EC_CURVE mode */
+
+	/* Temperature sampling for hwmon notifications, state owned by temp_work */
+	struct delayed_work temp_work;
+	unsigned long temp_read_stamp;	/* jiffies of the last temp attribute read */
+	bool exiting;			/* module unload, temp_work must not requeue */
+	long temp_max;			/* millidegree C */
+	long temp_crit;			/* millidegree C */
+	long notified_temp;
+	bool max_alarm;
+	bool crit_alarm;
+
+	/* Last known EC register contents and when they were seen */
+	spinlock_t shadow_lock;
+	u8 shadow[UW_SHADOW_SIZE];
+	unsigned long shadow_stamp[UW_SHADOW_SIZE];
+	DECLARE_BITMAP(shadow_valid, UW_SHADOW_SIZE);
+	/* What the driver last set each register to, restored after resume */
+	u8 written[UW_SHADOW_SIZE];
+	DECLARE_BITMAP(shadow_written, UW_SHADOW_SIZE);
+
+	/* Attempts needed until a fan speed read back correctly */
+	atomic_t write_attempts[UW_WRITE_MAX_ATTEMPTS];
+	atomic_t write_unverified;
+
+	struct uw_ec_stats ec_stats;
+
+	/* WMI argument and result buffers, reused by every call under ec_lock */
+	u32 wmi_arg[10];
+	union {
+		union acpi_object obj;
+		u8 bytes[UW_WMI_OUT_SIZE];
+	} wmi_out;
+
+	struct dentry *debugfs;
 };
 
-static int uw_ec_read(struct ibg10_data *data, u16 addr, u8 *value)
+static int uw_shadow_slot(u16 addr)
+{
+	int i;
+
+	if (addr >= UW_EC_FAN_TABLE_BASE && addr < UW_EC_FAN_TABLE_BASE + UW_EC_FAN_TABLE_LEN)
+		return addr - UW_EC_FAN_TABLE_BASE;
+
+	for (i = 0; i < ARRAY_SIZE(uw_shadow_regs); i++) {
+		if (uw_shadow_regs[i] == addr)
+			return UW_EC_FAN_TABLE_LEN + i;
+	}
+
+	return -1;
+}
+
+static u16 uw_shadow_addr(int slot)
+{
+	if (slot < UW_EC_FAN_TABLE_LEN)
+		return UW_EC_FAN_TABLE_BASE + slot;
+
+	return uw_shadow_regs[slot - UW_EC_FAN_TABLE_LEN];
+}
+
+static void uw_shadow_store(struct ibg10_data *data, u16 addr, u8 value)
+{
+	int slot = uw_shadow_slot(addr);
+
+	if (slot < 0)
+		return;
+
+	spin_lock(&data->shadow_lock);
+	data->shadow[slot] = value;
+	data->shadow_stamp[slot] = jiffies;
+	set_bit(slot, data->shadow_valid);
+	spin_unlock(&data->shadow_lock);
+}
+
+static void uw_shadow_drop(struct ibg10_data *data, u16 addr)
+{
+	int slot = uw_shadow_slot(addr);
+
+	if (slot < 0)
+		return;
+
+	spin_lock(&data->shadow_lock);
+	clear_bit(slot, data->shadow_valid);
+	spin_unlock(&data->shadow_lock);
+}
+
+/* Remember @value as set by the driver, whether or not it took a write */
+static void uw_shadow_want(struct ibg10_data *data, u16 addr, u8 value)
+{
+	int slot = uw_shadow_slot(addr);
+
+	if (slot < 0)
+		return;
+
+	spin_lock(&data->shadow_lock);
+	data->written[slot] = value;
+	set_bit(slot, data->shadow_written);
+	spin_unlock(&data->shadow_lock);
+}
+
+/* The EC owns @addr from now on: neither cached nor ours to restore */
+static void uw_shadow_forget(struct ibg10_data *data, u16 addr)
+{
+	int slot = uw_shadow_slot(addr);
+
+	if (slot < 0)
+		return;
+
+	spin_lock(&data->shadow_lock);
+	clear_bit(slot, data->shadow_valid);
+	clear_bit(slot, data->shadow_written);
+	spin_unlock(&data->shadow_lock);
+}
+
+/* Look up what the driver last set @addr to */
+static bool uw_shadow_get_written(struct ibg10_data *data, u16 addr, u8 *value)
+{
+	int slot = uw_shadow_slot(addr);
+	bool written;
+
+	if (slot < 0)
+		return false;
+
+	spin_lock(&data->shadow_lock);
+	written = test_bit(slot, data->shadow_written);
+	if (written)
+		*value = data->written[slot];
+	spin_unlock(&data->shadow_lock);
+
+	return written;
+}
+
+static bool uw_shadow_get(struct ibg10_data *data, u16 addr, u8 *value)
+{
+	int slot = uw_shadow_slot(addr);
+	bool valid;
+
+	if (slot < 0)
+		return false;
+
+	spin_lock(&data->shadow_lock);
+	valid = test_bit(slot, data->shadow_valid);
+	if (valid)
+		*value = data->shadow[slot];
+	spin_unlock(&data->shadow_lock);
+
+	return valid;
+}
+
+static bool uw_shadow_matches(struct ibg10_data *data, u16 addr, u8 value)
 {
+	u8 cur;
+
+	return uw_shadow_get(data, addr, &cur) && cur == value;
+}
+
+/* Look up a shadow value that was seen within the last @max_age jiffies */
+static bool uw_shadow_fresh(struct ibg10_data *data, u16 addr, unsigned long max_age, u8 *value)
+{
+	int slot = uw_shadow_slot(addr);
+	bool fresh;
+
+	if (slot < 0)
+		return false;
+
+	spin_lock(&data->shadow_lock);
+	fresh = test_bit(slot, data->shadow_valid) &&
+		time_before(jiffies, data->shadow_stamp[slot] + max_age);
+	if (fresh)
+		*value = data->shadow[slot];
+	spin_unlock(&data->shadow_lock);
+
+	return fresh;
+}
+
+/*
+ * Forget everything we believe the EC holds, so the next writes reach the
+ * hardware again. Used when the EC may have changed registers behind our back.
+ */
+static void uw_shadow_invalidate(struct ibg10_data *data)
+{
+	spin_lock(&data->shadow_lock);
+	bitmap_zero(data->shadow_valid, UW_SHADOW_SIZE);
+	spin_unlock(&data->shadow_lock);
+}
+
+static void uw_ec_lock(struct ibg10_data *data)
+{
+	struct uw_ec_stats *st = &data->ec_stats;
+	u64 start;
+
+	if (mutex_trylock(&data->ec_lock)) {
+		st->lock_stamp = ktime_get_ns();
+	} else {
+		start = ktime_get_ns();
+		mutex_lock(&data->ec_lock);
+		st->lock_stamp = ktime_get_ns();
+		st->lock_contended++;
+		st->lock_wait_ns += st->lock_stamp - start;
+	}
+	st->lock_acquired++;
+}
+
+static void uw_ec_unlock(struct ibg10_data *data)
+{
+	struct uw_ec_stats *st = &data->ec_stats;
+
+	st->lock_held_ns += ktime_get_ns() - st->lock_stamp;
+	mutex_unlock(&data->ec_lock);
+}
+
+static int uw_ec_stats_slot(u16 addr)
+{
+	int slot = uw_shadow_slot(addr);
+
+	return slot < 0 ? UW_SHADOW_SIZE : slot;
+}
+
+/*
+ * One WMI call into the EC, reusing the buffers in data. Results too large
+ * for wmi_out fall back to an allocated buffer. On success *result, if
+ * given, holds the first result byte. Must be called with ec_lock held.
+ *
+ * ACPI only reports the overflow after the method ran, so only reads are
+ * evaluated again. A write has already reached the EC and needs no result.
+ */
+static int uw_wmi_call(struct ibg10_data *data, u16 addr, u8 value, bool read, u8 *result)
+{
+	struct uw_ec_stats *st = &data->ec_stats;
+	u8 *arg_bytes = (u8 *)data->wmi_arg;
+	struct acpi_buffer in = { sizeof(data->wmi_arg), data->wmi_arg };
+	struct acpi_buffer out = { sizeof(data->wmi_out), &data->wmi_out };
+	union acpi_object *obj;
 	acpi_status status;
-	union acpi_object *out_obj;
-	u32 wmi_arg[10] = { 0 };
-	u8 *arg_bytes = (u8 *)wmi_arg;
-	struct acpi_buffer in = { sizeof(wmi_arg), wmi_arg };
-	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
+	u64 start, ns;
 	int ret = 0;
 
-	mutex_lock(&data->ec_lock);
-
+	memset(data->wmi_arg, 0, sizeof(data->wmi_arg));
 	arg_bytes[0] = addr & 0xff;
 	arg_bytes[1] = (addr >> 8) & 0xff;
-	arg_bytes[5] = 1; /* read */
+	arg_bytes[2] = value;
+	arg_bytes[5] = read;
 
+	start = ktime_get_ns();
 	status = wmi_evaluate_method(UNIWILL_WMI_MGMT_GUID_BC, 0, 4, &in, &out);
-	if (ACPI_FAILURE(status)) {
-		pr_err("WMI read failed for addr 0x%04x\n", addr);
+	if (status == AE_BUFFER_OVERFLOW && !read) {
+		status = AE_OK;
+	} else if (status == AE_BUFFER_OVERFLOW) {
+		out.length = ACPI_ALLOCATE_BUFFER;
+		out.pointer = NULL;
+		status = wmi_evaluate_method(UNIWILL_WMI_MGMT_GUID_BC, 0, 4, &in, &out);
+	}
+	ns = ktime_get_ns() - start;
+
+	st->wmi_calls++;
+	st->wmi_ns += ns;
+	st->wmi_max_ns = max(st->wmi_max_ns, ns);
+	st->wmi_hist[min_t(int, fls64(div_u64(ns, NSEC_PER_USEC)), UW_WMI_HIST_BUCKETS - 1)]++;
+
+	obj = out.pointer;
+	if (ACPI_FAILURE(status))
 		ret = -EIO;
-		goto out;
+	else if (result && !(obj && obj->type == ACPI_TYPE_BUFFER && obj->buffer.length >= 1))
+		ret = -ENODATA;
+	else if (result)
+		*result = obj->buffer.pointer[0];
+
+	if (out.pointer != &data->wmi_out)
+		kfree(out.pointer);
+	return ret;
+}
+
+/* Must be called with ec_lock held */
+static int __uw_ec_read(struct ibg10_data *data, u16 addr, u8 *value)
+{
+	u64 start = trace_uw_ec_read_enabled() ? ktime_get_ns() : 0;
+	int ret;
+
+	data->ec_stats.reads[uw_ec_stats_slot(addr)]++;
+	ret = uw_wmi_call(data, addr, 0, true, value);
+	if (ret) {
+		data->ec_stats.read_failures++;
+		if (ret == -EIO)
+			pr_err("WMI read failed for addr 0x%04x\n", addr);
+		ret = -EIO;
+	} else {
+		uw_shadow_store(data, addr, *value);
+	}
+
+	if (trace_uw_ec_read_enabled())
+		trace_uw_ec_read(addr, ret ? 0 : *value, 0, ret, ktime_get_ns() - start);
+	return ret;
+}
+
+/* Must be called with ec_lock held. Always reaches the EC. */
+static int __uw_ec_write(struct ibg10_data *data, u16 addr, u8 value)
+{
+	u64 start = trace_uw_ec_write_enabled() ? ktime_get_ns() : 0;
+	int retries = 0;
+	int ret;
+
+	data->ec_stats.writes[uw_ec_stats_slot(addr)]++;
+	while ((ret = uw_wmi_call(data, addr, value, false, NULL)) && ++retries < 3) {
+		data->ec_stats.write_retries++;
+		msleep(50);
+	}
+
+	if (ret) {
+		data->ec_stats.write_failures++;
+		pr_err("WMI write failed for addr 0x%04x\n", addr);
+		uw_shadow_drop(data, addr);
+		retries--;
+	} else {
+		uw_shadow_store(data, addr, value);
+		uw_shadow_want(data, addr, value);
 	}
 
-	out_obj = out.pointer;
-	if (out_obj && out_obj->type == ACPI_TYPE_BUFFER && out_obj->buffer.length >= 1)
-		*value = out_obj->buffer.pointer[0];
-	else
-		ret = -EIO;
+	if (trace_uw_ec_write_enabled())
+		trace_uw_ec_write(addr, value, retries, ret, ktime_get_ns() - start);
+	return ret;
+}
+
+static int uw_ec_read(struct ibg10_data *data, u16 addr, u8 *value)
+{
+	int ret;
+
+	uw_ec_lock(data);
+	ret = __uw_ec_read(data, addr, value);
+	uw_ec_unlock(data);
+
+	return ret;
+}
+
+/*
+ * Read a register through the read cache. Values seen less than cache_ms ago
+ * are returned without touching the EC, which is good enough for monitoring.
+ */
+static int uw_ec_read_cached(struct ibg10_data *data, u16 addr, u8 *value)
+{
+	unsigned long max_age = msecs_to_jiffies(READ_ONCE(cache_ms));
+	int ret = 0;
+
+	if (max_age && uw_shadow_fresh(data, addr, max_age, value))
+		return 0;
+
+	uw_ec_lock(data);
+	/* Another reader may have refreshed the value while we waited */
+	if (!max_age || !uw_shadow_fresh(data, addr, max_age, value))
+		ret = __uw_ec_read(data, addr, value);
+	uw_ec_unlock(data);
+
+	return ret;
+}
+
+/*
+ * Register accesses for uw_ec_batch(). Reads, forced writes and the bit
+ * operations always reach the EC, writes are skipped if the shadow already
+ * holds the value.
+ */
+enum uw_ec_op_type {
+	UW_EC_OP_READ,		/* value receives the register contents */
+	UW_EC_OP_WRITE,
+	UW_EC_OP_FORCE,		/* write even if the shadow matches, for mode registers */
+	UW_EC_OP_UPDATE,	/* write if different, compared against the shadow if possible */
+	UW_EC_OP_SET_BITS,	/* read, set the bits in value, write back if that changed it */
+	UW_EC_OP_CLEAR_BITS,
+};
+
+#define UW_EC_OP_FAILED        0x80 /* or'ed into type by uw_ec_batch() */
+
+struct uw_ec_op {
+	u16 addr;
+	u8 type;
+	u8 value;
+};
+
+#define UW_EC_OP(t, a, v)      ((struct uw_ec_op){ .addr = (a), .type = UW_EC_OP_##t, .value = (v) })
+
+/* Must be called with ec_lock held */
+static int __uw_ec_op(struct ibg10_data *data, struct uw_ec_op *op)
+{
+	u8 cur, val;
+	int ret;
+
+	switch (op->type) {
+	case UW_EC_OP_READ:
+		return __uw_ec_read(data, op->addr, &op->value);
+	case UW_EC_OP_WRITE:
+		if (!uw_shadow_matches(data, op->addr, op->value))
+			return __uw_ec_write(data, op->addr, op->value);
+		uw_shadow_want(data, op->addr, op->value);
+		return 0;
+	case UW_EC_OP_FORCE:
+		return __uw_ec_write(data, op->addr, op->value);
+	case UW_EC_OP_UPDATE:
+		/* Registers not in the shadow yet cost a read instead of a write */
+		if (!uw_shadow_get(data, op->addr, &cur) && __uw_ec_read(data, op->addr, &cur))
+			cur = ~op->value;
+		if (cur != op->value)
+			return __uw_ec_write(data, op->addr, op->value);
+		uw_shadow_want(data, op->addr, op->value);
+		return 0;
+	case UW_EC_OP_SET_BITS:
+	case UW_EC_OP_CLEAR_BITS:
+		ret = __uw_ec_read(data, op->addr, &cur);
+		if (ret)
+			return ret;
+		val = op->type == UW_EC_OP_SET_BITS ? cur | op->value : cur & ~op->value;
+		if (val != cur)
+			return __uw_ec_write(data, op->addr, val);
+		uw_shadow_want(data, op->addr, val);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Run @n register accesses in order under a single ec_lock hold. All ops
+ * are attempted; failed ones get UW_EC_OP_FAILED and the first error is
+ * returned.
+ */
+static int uw_ec_batch(struct ibg10_data *data, struct uw_ec_op *ops, unsigned int n)
+{
+	unsigned int i;
+	int ret, err = 0;
+
+	uw_ec_lock(data);
+	for (i = 0; i < n; i++) {
+		ret = __uw_ec_op(data, &ops[i]);
+		if (ret) {
+			ops[i].type |= UW_EC_OP_FAILED;
+			if (!err)
+				err = ret;
+		}
+	}
+	uw_ec_unlock(data);
+
+	return err;
+}
+
+static u8 fan_clamp_speed(u8 speed)
+{
+	if (speed > FAN_SPEED_MAX)
+		speed = FAN_SPEED_MAX;
+
+	if (speed == 0)
+		speed = 1;
+	else if (speed < FAN_ON_MIN_SPEED)
+		speed = FAN_ON_MIN_SPEED;
+
+	return speed;
+}
+
+/*
+ * Table for manual control: zone 0 covers every reachable temperature with
+ * the speed set through pwmN, the remaining zones sit above 115 C at full
+ * speed.
+ */
+static void fan_table_build_manual(u8 *table)
+{
+	u8 temp_offset = 115;
+	int i;
+
+	table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_END_TEMP)] = 115;
+	table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_START_TEMP)] = 0;
+	table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED)] = 0x00;
+
+	table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_END_TEMP)] = 120;
+	table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_START_TEMP)] = 0;
+	table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED)] = 0x00;
+
+	for (i = 1; i < UW_EC_FAN_TABLE_ZONES; i++) {
+		table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_END_TEMP) + i] = temp_offset + i + 1;
+		table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_START_TEMP) + i] = temp_offset + i;
+		table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED) + i] = FAN_SPEED_MAX;
+
+		table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_END_TEMP) + i] = temp_offset + i + 1;
+		table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_START_TEMP) + i] = temp_offset + i;
+		table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED) + i] = FAN_SPEED_MAX;
+	}
+}
+
+/* Append an update of every fan table entry to @ops, returns the number of ops */
+static unsigned int fan_table_ops(struct uw_ec_op *ops, const u8 *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < UW_EC_FAN_TABLE_LEN; i++)
+		ops[i] = UW_EC_OP(UPDATE, UW_EC_FAN_TABLE_BASE + i, table[i]);
+
+	return UW_EC_FAN_TABLE_LEN;
+}
+
+/* Bring the EC fan table in line with @table, touching only changed entries */
+static int fan_table_apply(struct ibg10_data *data, const u8 *table)
+{
+	struct uw_ec_op ops[UW_EC_FAN_TABLE_LEN];
+
+	return uw_ec_batch(data, ops, fan_table_ops(ops, table));
+}
+
+/*
+ * Switch the EC to the custom fan table given in @table. With @manual set,
+ * the EC additionally honours the direct speed registers.
+ */
+static void fan_enable_custom_table(struct ibg10_data *data, const u8 *table, bool manual)
+{
+	struct uw_ec_op toggle = UW_EC_OP(CLEAR_BITS, UW_EC_REG_CUSTOM_PROFILE, UW_EC_CUSTOM_PROFILE_BIT);
+	struct uw_ec_op ops[4 + UW_EC_FAN_TABLE_LEN + 1];
+	unsigned int n = 0;
+
+	/* Toggle custom profile bit, without holding ec_lock across the delay */
+	uw_ec_batch(data, &toggle, 1);
+	msleep(50);
+
+	ops[n++] = UW_EC_OP(SET_BITS, UW_EC_REG_CUSTOM_PROFILE, UW_EC_CUSTOM_PROFILE_BIT);
+	/* Enable manual mode, firmware may have dropped it without us noticing */
+	ops[n++] = UW_EC_OP(FORCE, UW_EC_REG_MANUAL_MODE, manual ? 0x01 : 0x00);
+	/* Disable full fan mode */
+	ops[n++] = UW_EC_OP(CLEAR_BITS, UW_EC_REG_FAN_MODE, UW_EC_FAN_MODE_BIT);
+	/* Enable custom fan table 0 (bit 7) */
+	ops[n++] = UW_EC_OP(SET_BITS, UW_EC_REG_USE_CUSTOM_FAN_TABLE_0, BIT(7));
+	n += fan_table_ops(&ops[n], table);
+	/* Enable custom fan table 1 (bit 2) */
+	ops[n++] = UW_EC_OP(SET_BITS, UW_EC_REG_USE_CUSTOM_FAN_TABLE_1, BIT(2));
+
+	uw_ec_batch(data, ops, n);
+}
+
+/*
+ * Sampling is only worth an EC read while userspace drives the fans (manual
+ * or in-kernel curve mode) or keeps reading the temperature attributes.
+ * sysfs doesn't tell us whether anyone is blocked in poll(), so that is the
+ * best guess we have. Hence the slow default of temp_sample_ms: each sample
+ * wakes the CPU for a WMI call, also while the daemon sleeps its idle ticks.
+ */
+static bool ibg10_temp_wanted(struct ibg10_data *data)
+{
+	if (READ_ONCE(data->exiting) || !READ_ONCE(temp_sample_ms))
+		return false;
+	if (READ_ONCE(data->fans_initialized))
+		return true;
+	return time_before(jiffies, READ_ONCE(data->temp_read_stamp) +
+			   msecs_to_jiffies(IBG10_TEMP_IDLE_MS));
+}
+
+/* Start temp_work if it is wanted and not queued yet */
+static void ibg10_temp_start(struct ibg10_data *data)
+{
+	unsigned int ms = READ_ONCE(temp_sample_ms);
+
+	if (ibg10_temp_wanted(data))
+		queue_delayed_work(system_freezable_power_efficient_wq, &data->temp_work,
+				   msecs_to_jiffies(max(ms, 100U)));
+}
+
+static int init_custom_fan_table(struct ibg10_data *data)
+{
+	u8 table[UW_EC_FAN_TABLE_LEN];
+	u64 start;
+
+	if (data->fans_initialized)
+		return 0;
+
+	start = trace_init_custom_fan_table_enabled() ? ktime_get_ns() : 0;
+	pr_info("Initializing custom fan table...\n");
+
+	fan_table_build_manual(table);
+	fan_enable_custom_table(data, table, true);
+
+	data->ec_curve = false;
+	data->fans_initialized = true;
+	pr_info("Custom fan table initialized\n");
+	ibg10_temp_start(data);
+
+	if (trace_init_custom_fan_table_enabled())
+		trace_init_custom_fan_table(0, ktime_get_ns() - start);
+	return 0;
+}
+
+static void ibg10_init_work(struct work_struct *work)
+{
+	struct ibg10_data *data = container_of(work, struct ibg10_data, init_work);
+
+	mutex_lock(&data->fan_lock);
+	init_custom_fan_table(data);
+	mutex_unlock(&data->fan_lock);
+}
+
+static int fan_get_temp(struct ibg10_data *data)
+{
+	u8 temp;
+
+	if (uw_ec_read_cached(data, UW_EC_REG_FAN1_TEMP, &temp) < 0)
+		return -EIO;
+
+	return temp * 1000; /* millidegree C */
+}
+
+static int fan_get_speed(struct ibg10_data *data, int fan_idx)
+{
+	u8 speed;
+	u16 addr = (fan_idx == 0) ? UW_EC_REG_FAN1_SPEED : UW_EC_REG_FAN2_SPEED;
+
+	if (uw_ec_read_cached(data, addr, &speed) < 0)
+		return -EIO;
+
+	return speed;
+}
+
+static const u16 fan_table_speed_reg[2] = {
+	UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED,
+	UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED,
+};
+
+static const u16 fan_direct_speed_reg[2] = {
+	UW_EC_REG_FAN1_SPEED,
+	UW_EC_REG_FAN2_SPEED,
+};
+
+/*
+ * Set the fans in @mask to the same speed in one EC transaction. The direct
+ * speed registers are written and read back until the EC reports the new
+ * value, instead of blindly repeating the write. Fans are handled
+ * interleaved, so both share every attempt and delay.
+ */
+static int fan_set_speeds(struct ibg10_data *data, unsigned long mask, u8 speed)
+{
+	unsigned int tries = clamp_val(READ_ONCE(write_retries), 1, UW_WRITE_MAX_ATTEMPTS);
+	unsigned long requested;
+	unsigned int attempt;
+	u64 start = 0;
+	u8 readback;
+	int i, err, ret = 0;
+
+	if (!data->fans_initialized)
+		ret = init_custom_fan_table(data);
+
+	speed = fan_clamp_speed(speed);
+
+	/* Nothing to do for fans the EC already runs at this speed */
+	for (i = 0; i < ARRAY_SIZE(fan_direct_speed_reg); i++) {
+		if (uw_shadow_matches(data, fan_table_speed_reg[i], speed) &&
+		    uw_shadow_matches(data, fan_direct_speed_reg[i], speed))
+			clear_bit(i, &mask);
+	}
+
+	if (!mask)
+		return ret;
+
+	if (trace_fan_set_speed_enabled())
+		start = ktime_get_ns();
+	requested = mask;
+
+	uw_ec_lock(data);
+
+	/* Keep the first error, a later success doesn't make up for it */
+	for_each_set_bit(i, &mask, ARRAY_SIZE(fan_table_speed_reg)) {
+		if (uw_shadow_matches(data, fan_table_speed_reg[i], speed))
+			continue;
+		err = __uw_ec_write(data, fan_table_speed_reg[i], speed);
+		if (err && !ret)
+			ret = err;
+	}
+
+	for (attempt = 1; attempt <= tries && mask; attempt++) {
+		for_each_set_bit(i, &mask, ARRAY_SIZE(fan_direct_speed_reg)) {
+			err = __uw_ec_write(data, fan_direct_speed_reg[i], speed);
+			if (err && !ret)
+				ret = err;
+		}
+
+		for_each_set_bit(i, &mask, ARRAY_SIZE(fan_direct_speed_reg)) {
+			if (__uw_ec_read(data, fan_direct_speed_reg[i], &readback) == 0 &&
+			    readback == speed) {
+				clear_bit(i, &mask);
+				atomic_inc(&data->write_attempts[attempt - 1]);
+			}
+		}
+
+		if (mask && attempt < tries)
+			msleep(READ_ONCE(write_delay_ms));
+	}
+
+	uw_ec_unlock(data);
+
+	if (trace_fan_set_speed_enabled())
+		trace_fan_set_speed(requested, speed, attempt - 1, mask, ret, ktime_get_ns() - start);
+
+	for_each_set_bit(i, &mask, ARRAY_SIZE(fan_direct_speed_reg)) {
+		atomic_inc(&data->write_unverified);
+		pr_debug("EC did not accept speed %u for fan %d after %u attempts\n",
+			 speed, i + 1, tries);
+	}
+
+	/* A mismatching readback is not an error, the shadow now holds it */
+	return ret;
+}
+
+static int fan_set_speed(struct ibg10_data *data, int fan_idx, u8 speed)
+{
+	return fan_set_speeds(data, BIT(fan_idx), speed);
+}
+
+/*
+ * Remember the newest speed for the fans in @mask and let pwm_work apply it.
+ * Values that are overwritten before the work runs never reach the EC.
+ */
+static int fan_queue_speeds(struct ibg10_data *data, unsigned long mask, u8 speed)
+{
+	int i;
+
+	spin_lock(&data->pending_lock);
+	for_each_set_bit(i, &mask, ARRAY_SIZE(data->pending_speed))
+		data->pending_speed[i] = speed;
+	data->pending |= mask;
+	spin_unlock(&data->pending_lock);
+
+	schedule_work(&data->pwm_work);
+	return 0;
+}
 
-	kfree(out_obj);
-out:
-	mutex_unlock(&data->ec_lock);
-	return ret;
+/*
+ * Set or queue a speed for the fans in @mask, -EBUSY if a curve drives any
+ * of them. Must be called with fan_lock held, so fan_set_mode() can't switch
+ * a fan to a curve between the check and the write.
+ */
+static int fan_write_speeds(struct ibg10_data *data, unsigned long mask, u8 speed)
+{
+	if ((data->curve_channels & mask) || data->ec_curve)
+		return -EBUSY;
+	if (READ_ONCE(async_write))
+		return fan_queue_speeds(data, mask, speed);
+
+	return fan_set_speeds(data, mask, speed);
 }
 
-static int uw_ec_write(struct ibg10_data *data, u16 addr, u8 value)
+static void fan_drop_pending(struct ibg10_data *data, unsigned long mask)
 {
-	acpi_status status;
-	u32 wmi_arg[10] = { 0 };
-	u8 *arg_bytes = (u8 *)wmi_arg;
-	struct acpi_buffer in = { sizeof(wmi_arg), wmi_arg };
-	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
-	int ret = 0;
-	int retries = 3;
+	spin_lock(&data->pending_lock);
+	data->pending &= ~mask;
+	spin_unlock(&data->pending_lock);
+}
 
-	mutex_lock(&data->ec_lock);
+static void ibg10_pwm_work(struct work_struct *work)
+{
+	struct ibg10_data *data = container_of(work, struct ibg10_data, pwm_work);
+	unsigned long pending;
+	u8 speed[2];
+	int i;
 
-retry:
-	memset(wmi_arg, 0, sizeof(wmi_arg));
+	mutex_lock(&data->fan_lock);
 
-	arg_bytes[0] = addr & 0xff;
-	arg_bytes[1] = (addr >> 8) & 0xff;
-	arg_bytes[2] = value;
-	arg_bytes[5] = 0; /* write */
+	spin_lock(&data->pending_lock);
+	pending = data->pending;
+	data->pending = 0;
+	memcpy(speed, data->pending_speed, sizeof(speed));
+	spin_unlock(&data->pending_lock);
 
-	status = wmi_evaluate_method(UNIWILL_WMI_MGMT_GUID_BC, 0, 4, &in, &out);
-	if (ACPI_FAILURE(status)) {
-		if (--retries > 0) {
-			msleep(50);
-			goto retry;
-		}
-		pr_err("WMI write failed for addr 0x%04x\n", addr);
-		ret = -EIO;
+	if (pending == (BIT(0) | BIT(1)) && speed[0] == speed[1]) {
+		/* Same target for both fans, as written by pwm_all */
+		fan_set_speeds(data, pending, speed[0]);
+	} else {
+		for_each_set_bit(i, &pending, ARRAY_SIZE(speed))
+			fan_set_speed(data, i, speed[i]);
 	}
 
-	kfree(out.pointer);
-	mutex_unlock(&data->ec_lock);
-	return ret;
+	mutex_unlock(&data->fan_lock);
 }
 
-static int init_custom_fan_table(struct ibg10_data *data)
+static int fan_set_auto(struct ibg10_data *data)
 {
-	u8 val0, val1;
-	int i;
-	u8 temp_offset = 115;
+	u64 start = trace_fan_set_auto_enabled() ? ktime_get_ns() : 0;
+	struct uw_ec_op ops[] = {
+		UW_EC_OP(CLEAR_BITS, UW_EC_REG_USE_CUSTOM_FAN_TABLE_1, BIT(2)),
+		UW_EC_OP(CLEAR_BITS, UW_EC_REG_USE_CUSTOM_FAN_TABLE_0, BIT(7)),
+		UW_EC_OP(CLEAR_BITS, UW_EC_REG_FAN_MODE, UW_EC_FAN_MODE_BIT),
+		UW_EC_OP(FORCE, UW_EC_REG_MANUAL_MODE, 0x00),
+		UW_EC_OP(CLEAR_BITS, UW_EC_REG_CUSTOM_PROFILE, UW_EC_CUSTOM_PROFILE_BIT),
+	};
+
+	uw_ec_batch(data, ops, ARRAY_SIZE(ops));
+
+	/* The EC drives the fans from here on, our speed values are stale */
+	uw_shadow_forget(data, UW_EC_REG_FAN1_SPEED);
+	uw_shadow_forget(data, UW_EC_REG_FAN2_SPEED);
+
+	data->ec_curve = false;
+	data->fans_initialized = false;
+	pr_info("Restored automatic fan control\n");
 
-	if (data->fans_initialized)
-		return 0;
+	if (trace_fan_set_auto_enabled())
+		trace_fan_set_auto(0, ktime_get_ns() - start);
+	return 0;
+}
 
-	pr_info("Initializing custom fan table...\n");
+static long curve_interpolate(const struct ibg10_curve *curve, long temp)
+{
+	int i;
 
-	/* Toggle custom profile bit */
-	uw_ec_read(data, UW_EC_REG_CUSTOM_PROFILE, &val0);
-	val0 &= ~UW_EC_CUSTOM_PROFILE_BIT;
-	uw_ec_write(data, UW_EC_REG_CUSTOM_PROFILE, val0);
-	msleep(50);
-	val0 |= UW_EC_CUSTOM_PROFILE_BIT;
-	uw_ec_write(data, UW_EC_REG_CUSTOM_PROFILE, val0);
+	if (temp <= curve->temp[0])
+		return curve->pwm[0];
 
-	/* Enable manual mode */
-	uw_ec_write(data, UW_EC_REG_MANUAL_MODE, 0x01);
+	for (i = 1; i < IBG10_CURVE_POINTS; i++) {
+		if (temp <= curve->temp[i])
+			return curve->pwm[i - 1] +
+			       (curve->pwm[i] - curve->pwm[i - 1]) * (temp - curve->temp[i - 1]) /
+			       (curve->temp[i] - curve->temp[i - 1]);
+	}
 
-	/* Disable full fan mode */
-	uw_ec_read(data, UW_EC_REG_FAN_MODE, &val0);
-	if (val0 & UW_EC_FAN_MODE_BIT)
-		uw_ec_write(data, UW_EC_REG_FAN_MODE, val0 & ~UW_EC_FAN_MODE_BIT);
+	return curve->pwm[IBG10_CURVE_POINTS - 1];
+}
 
-	/* Enable custom fan table 0 (bit 7) */
-	uw_ec_read(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_0, &val0);
-	if (!((val0 >> 7) & 1))
-		uw_ec_write(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_0, val0 | BIT(7));
+/* Same hysteresis as the daemon: only slow down once the curve is clearly below */
+static long curve_calc_target(const struct ibg10_curve *curve, long temp, int current_pwm)
+{
+	long target = curve_interpolate(curve, temp);
+	long hyst = READ_ONCE(curve_hysteresis) * 1000L;
 
-	/* CPU fan table - zone 0 */
-	uw_ec_write(data, UW_EC_REG_CPU_FAN_TABLE_END_TEMP, 115);
-	uw_ec_write(data, UW_EC_REG_CPU_FAN_TABLE_START_TEMP, 0);
-	uw_ec_write(data, UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED, 0x00);
+	if (current_pwm >= 0 && target < current_pwm &&
+	    curve_interpolate(curve, temp + hyst) >= current_pwm)
+		target = current_pwm;
 
-	/* GPU fan table - zone 0 */
-	uw_ec_write(data, UW_EC_REG_GPU_FAN_TABLE_END_TEMP, 120);
-	uw_ec_write(data, UW_EC_REG_GPU_FAN_TABLE_START_TEMP, 0);
-	uw_ec_write(data, UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED, 0x00);
+	return target;
+}
 
-	for (i = 1; i <= 15; i++) {
-		uw_ec_write(data, UW_EC_REG_CPU_FAN_TABLE_END_TEMP + i, temp_offset + i + 1);
-		uw_ec_write(data, UW_EC_REG_CPU_FAN_TABLE_START_TEMP + i, temp_offset + i);
-		uw_ec_write(data, UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED + i, FAN_SPEED_MAX);
+static u8 curve_ec_speed(long pwm)
+{
+	return fan_clamp_speed((pwm * FAN_SPEED_MAX) / 255);
+}
 
-		uw_ec_write(data, UW_EC_REG_GPU_FAN_TABLE_END_TEMP + i, temp_offset + i + 1);
-		uw_ec_write(data, UW_EC_REG_GPU_FAN_TABLE_START_TEMP + i, temp_offset + i);
-		uw_ec_write(data, UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED + i, FAN_SPEED_MAX);
+/*
+ * Translate a fan curve into one EC fan table (16 zones of start temp, end
+ * temp and speed, whole degrees C). Every segment between two curve points
+ * becomes IBG10_CURVE_ZONE_STEPS zones that follow the curve from below.
+ * Zones left over are parked above the top zone at full speed, like in the
+ * manual table.
+ */
+static void fan_table_build_curve(u8 *end_temp, u8 *start_temp, u8 *speed,
+				  const struct ibg10_curve *curve)
+{
+	int zone = 0;
+	int i, j;
+	long t;
+	u8 deg;
+
+	start_temp[0] = 0;
+	speed[0] = curve_ec_speed(curve->pwm[0]);
+
+	for (i = 1; i < IBG10_CURVE_POINTS; i++) {
+		for (j = 0; j < IBG10_CURVE_ZONE_STEPS; j++) {
+			t = curve->temp[i - 1] +
+			    (curve->temp[i] - curve->temp[i - 1]) * j / IBG10_CURVE_ZONE_STEPS;
+			deg = t / 1000;
+
+			/* Steps closer than a degree collapse into one zone */
+			if (deg > start_temp[zone]) {
+				end_temp[zone] = deg;
+				start_temp[++zone] = deg;
+			}
+			speed[zone] = curve_ec_speed(curve_interpolate(curve, t));
+		}
 	}
 
-	/* Enable custom fan table 1 (bit 2) */
-	uw_ec_read(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_1, &val1);
-	if (!((val1 >> 2) & 1))
-		uw_ec_write(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_1, val1 | BIT(2));
+	deg = curve->temp[IBG10_CURVE_POINTS - 1] / 1000;
+	if (deg > start_temp[zone]) {
+		end_temp[zone] = deg;
+		start_temp[++zone] = deg;
+	}
+	speed[zone] = curve_ec_speed(curve->pwm[IBG10_CURVE_POINTS - 1]);
+	end_temp[zone] = IBG10_CURVE_TEMP_MAX / 1000;
 
-	data->fans_initialized = true;
-	pr_info("Custom fan table initialized\n");
-	return 0;
+	for (zone++; zone < UW_EC_FAN_TABLE_ZONES; zone++) {
+		start_temp[zone] = end_temp[zone - 1];
+		end_temp[zone] = start_temp[zone] + 1;
+		speed[zone] = FAN_SPEED_MAX;
+	}
 }
 
-static int fan_get_temp(struct ibg10_data *data)
+/*
+ * Program both fan curves into the EC tables and leave the fans to the EC
+ * firmware. Must be called with fan_lock held.
+ */
+static void fan_set_ec_curve(struct ibg10_data *data)
 {
-	u8 temp;
+	u8 table[UW_EC_FAN_TABLE_LEN];
+
+	fan_table_build_curve(&table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_END_TEMP)],
+			      &table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_START_TEMP)],
+			      &table[UW_FAN_TABLE_IDX(UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED)],
+			      &data->curve[0]);
+	fan_table_build_curve(&table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_END_TEMP)],
+			      &table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_START_TEMP)],
+			      &table[UW_FAN_TABLE_IDX(UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED)],
+			      &data->curve[1]);
+
+	if (data->ec_curve) {
+		/* Already running from the table, only update changed zones */
+		fan_table_apply(data, table);
+		return;
+	}
 
-	if (uw_ec_read(data, UW_EC_REG_FAN1_TEMP, &temp) < 0)
-		return -EIO;
+	pr_info("Handing fan curve to the EC...\n");
+	fan_enable_custom_table(data, table, false);
 
-	return temp * 1000; /* millidegree C */
+	/* The EC drives the direct speed registers now */
+	uw_shadow_forget(data, UW_EC_REG_FAN1_SPEED);
+	uw_shadow_forget(data, UW_EC_REG_FAN2_SPEED);
+
+	data->ec_curve = true;
+	data->fans_initialized = false;
 }
 
-static int fan_get_speed(struct ibg10_data *data, int fan_idx)
+static void ibg10_curve_work(struct work_struct *work)
 {
-	u8 speed;
-	u16 addr = (fan_idx == 0) ? UW_EC_REG_FAN1_SPEED : UW_EC_REG_FAN2_SPEED;
+	struct ibg10_data *data = container_of(to_delayed_work(work), struct ibg10_data,
+					       curve_work);
+	long target;
+	u8 temp;
+	int i;
 
-	if (uw_ec_read(data, addr, &speed) < 0)
-		return -EIO;
+	mutex_lock(&data->fan_lock);
 
-	return speed;
+	if (!data->curve_channels)
+		goto out;
+
+	if (uw_ec_read(data, UW_EC_REG_FAN1_TEMP, &temp) == 0) {
+		for (i = 0; i < ARRAY_SIZE(data->curve); i++) {
+			if (!test_bit(i, &data->curve_channels))
+				continue;
+
+			target = curve_calc_target(&data->curve[i], temp * 1000L,
+						   data->curve_pwm[i]);
+			data->curve_pwm[i] = target;
+			fan_set_speed(data, i, (target * FAN_SPEED_MAX) / 255);
+		}
+	}
+
+	queue_delayed_work(system_freezable_wq, &data->curve_work,
+			   msecs_to_jiffies(max(READ_ONCE(curve_interval_ms), 100U)));
+out:
+	mutex_unlock(&data->fan_lock);
 }
 
-static int fan_set_speed(struct ibg10_data *data, int fan_idx, u8 speed)
+/* Registers that select the EC's fan mode, as opposed to table and speed values */
+static bool uw_is_mode_reg(u16 addr)
 {
-	u16 table_addr, direct_addr;
-	int i;
-
-	if (!data->fans_initialized)
-		init_custom_fan_table(data);
+	return addr == UW_EC_REG_USE_CUSTOM_FAN_TABLE_0 || addr == UW_EC_REG_USE_CUSTOM_FAN_TABLE_1 ||
+	       addr == UW_EC_REG_CUSTOM_PROFILE || addr == UW_EC_REG_MANUAL_MODE ||
+	       addr == UW_EC_REG_FAN_MODE;
+}
 
-	table_addr = (fan_idx == 0) ? UW_EC_REG_CPU_FAN_TABLE_FAN_SPEED : UW_EC_REG_GPU_FAN_TABLE_FAN_SPEED;
-	direct_addr = (fan_idx == 0) ? UW_EC_REG_FAN1_SPEED : UW_EC_REG_FAN2_SPEED;
+/*
+ * The EC may come back from suspend with firmware fan control and default
+ * tables. Read back every register the driver wrote and rewrite only the
+ * ones that differ. Lost mode bits need the full table enable sequence
+ * first. Runs from a work item so system resume doesn't wait for the EC.
+ */
+static void ibg10_resume_work(struct work_struct *work)
+{
+	struct ibg10_data *data = container_of(work, struct ibg10_data, resume_work);
+	struct uw_ec_op ops[UW_SHADOW_SIZE];
+	u8 want[UW_SHADOW_SIZE];
+	bool mode_lost = false;
+	unsigned int i, n = 0, changed = 0;
+	u16 addr;
+
+	mutex_lock(&data->fan_lock);
+
+	if (!data->fans_initialized && !data->ec_curve) {
+		/* The EC was in charge before, nothing of ours to restore */
+		uw_shadow_invalidate(data);
+		goto out;
+	}
 
-	if (speed > FAN_SPEED_MAX)
-		speed = FAN_SPEED_MAX;
+	for (i = 0; i < UW_SHADOW_SIZE; i++) {
+		addr = uw_shadow_addr(i);
+		/* The EC's own table drives the speeds in ec_curve mode */
+		if (data->ec_curve &&
+		    (addr == UW_EC_REG_FAN1_SPEED || addr == UW_EC_REG_FAN2_SPEED))
+			continue;
+		if (!uw_shadow_get_written(data, addr, &want[n]))
+			continue;
+		ops[n++] = UW_EC_OP(READ, addr, 0);
+	}
 
-	if (speed == 0)
-		speed = 1;
-	else if (speed < FAN_ON_MIN_SPEED)
-		speed = FAN_ON_MIN_SPEED;
+	/* This refreshes the shadow with what the EC holds now */
+	uw_ec_batch(data, ops, n);
+
+	for (i = 0; i < n; i++) {
+		if (!(ops[i].type & UW_EC_OP_FAILED) && ops[i].value == want[i])
+			continue;
+		/* Unknown now, so the write below must not be skipped */
+		if (ops[i].type & UW_EC_OP_FAILED)
+			uw_shadow_drop(data, ops[i].addr);
+		if (uw_is_mode_reg(ops[i].addr))
+			mode_lost = true;
+		changed++;
+	}
 
-	uw_ec_write(data, table_addr, speed);
+	if (!changed)
+		goto out;
 
-	for (i = 0; i < 5; i++) {
-		uw_ec_write(data, direct_addr, speed);
-		msleep(10);
+	pr_info("Restoring %u EC registers after resume\n", changed);
+	if (mode_lost) {
+		if (data->ec_curve) {
+			data->ec_curve = false;
+			fan_set_ec_curve(data);
+		} else {
+			data->fans_initialized = false;
+			init_custom_fan_table(data);
+		}
 	}
 
-	return 0;
+	/* Registers that already hold the value, also after the mode setup, are skipped */
+	for (i = 0; i < n; i++)
+		ops[i] = UW_EC_OP(WRITE, ops[i].addr, want[i]);
+	uw_ec_batch(data, ops, n);
+
+	/* Wake up temp1_input pollers such as the daemon to re-check their targets */
+	hwmon_notify_event(data->hwmon_dev, hwmon_temp, hwmon_temp_input, 0);
+out:
+	mutex_unlock(&data->fan_lock);
 }
 
-static int fan_set_auto(struct ibg10_data *data)
+/*
+ * Sample the EC temperature and wake up poll()ers of temp1_input when it
+ * moved by temp_notify_delta or crossed temp1_max/temp1_crit, so userspace
+ * doesn't need to poll on a fixed interval. Stops requeueing itself once
+ * ibg10_temp_wanted() says nobody is interested.
+ */
+static void ibg10_temp_work(struct work_struct *work)
 {
-	u8 val0, val1, mode;
+	struct ibg10_data *data = container_of(to_delayed_work(work), struct ibg10_data,
+					       temp_work);
+	long delta = READ_ONCE(temp_notify_delta) * 1000L;
+	bool alarm, notify;
+	long temp;
+	u8 raw;
+
+	if (READ_ONCE(data->exiting))
+		return;
+
+	if (uw_ec_read(data, UW_EC_REG_FAN1_TEMP, &raw) == 0) {
+		temp = raw * 1000L;
+		notify = delta && abs(temp - data->notified_temp) >= delta;
 
-	uw_ec_read(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_1, &val1);
-	if ((val1 >> 2) & 1)
-		uw_ec_write(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_1, val1 & ~BIT(2));
+		alarm = temp >= READ_ONCE(data->temp_max);
+		if (alarm != data->max_alarm) {
+			data->max_alarm = alarm;
+			hwmon_notify_event(data->hwmon_dev, hwmon_temp, hwmon_temp_max_alarm, 0);
+			notify = true;
+		}
 
-	uw_ec_read(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_0, &val0);
-	if ((val0 >> 7) & 1)
-		uw_ec_write(data, UW_EC_REG_USE_CUSTOM_FAN_TABLE_0, val0 & ~BIT(7));
+		alarm = temp >= READ_ONCE(data->temp_crit);
+		if (alarm != data->crit_alarm) {
+			data->crit_alarm = alarm;
+			hwmon_notify_event(data->hwmon_dev, hwmon_temp, hwmon_temp_crit_alarm, 0);
+			notify = true;
+		}
 
-	uw_ec_read(data, UW_EC_REG_FAN_MODE, &mode);
-	if (mode & UW_EC_FAN_MODE_BIT)
-		uw_ec_write(data, UW_EC_REG_FAN_MODE, mode & ~UW_EC_FAN_MODE_BIT);
+		if (notify) {
+			data->notified_temp = temp;
+			hwmon_notify_event(data->hwmon_dev, hwmon_temp, hwmon_temp_input, 0);
+		}
+	}
 
-	uw_ec_write(data, UW_EC_REG_MANUAL_MODE, 0x00);
+	ibg10_temp_start(data);
+}
 
-	uw_ec_read(data, UW_EC_REG_CUSTOM_PROFILE, &val0);
-	if (val0 & UW_EC_CUSTOM_PROFILE_BIT)
-		uw_ec_write(data, UW_EC_REG_CUSTOM_PROFILE, val0 & ~UW_EC_CUSTOM_PROFILE_BIT);
+/* Must be called with fan_lock held */
+static int fan_set_mode(struct ibg10_data *data, int channel, long mode)
+{
+	int ret;
 
-	data->fans_initialized = false;
-	pr_info("Restored automatic fan control\n");
-	return 0;
+	switch (mode) {
+	case IBG10_PWM_AUTO:
+		/* Queued speeds must not switch back to manual mode */
+		data->curve_channels = 0;
+		fan_drop_pending(data, ~0UL);
+		cancel_delayed_work(&data->temp_work);
+		return fan_set_auto(data);
+	case IBG10_PWM_MANUAL:
+		clear_bit(channel, &data->curve_channels);
+		return init_custom_fan_table(data);
+	case IBG10_PWM_EC_CURVE:
+		/* Like automatic mode, this applies to both fans */
+		data->curve_channels = 0;
+		fan_drop_pending(data, ~0UL);
+		cancel_delayed_work(&data->temp_work);
+		fan_set_ec_curve(data);
+		return 0;
+	case IBG10_PWM_CURVE:
+		ret = init_custom_fan_table(data);
+		if (ret)
+			return ret;
+
+		fan_drop_pending(data, BIT(channel));
+		data->curve_pwm[channel] = -1;
+		set_bit(channel, &data->curve_channels);
+		mod_delayed_work(system_freezable_wq, &data->curve_work, 0);
+		return 0;
+	default:
+		return -EINVAL;
+	}
 }
 
 /* hwmon callbacks */
@@ -286,8 +1328,11 @@ static umode_t ibg10_is_visible(const void *drvdata, enum hwmon_sensor_types typ
 {
 	switch (type) {
 	case hwmon_temp:
-		if (attr == hwmon_temp_input || attr == hwmon_temp_label)
+		if (attr == hwmon_temp_input || attr == hwmon_temp_label ||
+		    attr == hwmon_temp_max_alarm || attr == hwmon_temp_crit_alarm)
 			return 0444;
+		if (attr == hwmon_temp_max || attr == hwmon_temp_crit)
+			return 0644;
 		break;
 	case hwmon_pwm:
 		if (attr == hwmon_pwm_input || attr == hwmon_pwm_enable)
@@ -308,12 +1353,29 @@ static int ibg10_read(struct device *dev, enum hwmon_sensor_types type,
 
 	switch (type) {
 	case hwmon_temp:
-		if (attr == hwmon_temp_input) {
+		/* Someone is watching, keep the alarms and notifications current */
+		WRITE_ONCE(data->temp_read_stamp, jiffies);
+		ibg10_temp_start(data);
+
+		switch (attr) {
+		case hwmon_temp_input:
 			ret = fan_get_temp(data);
 			if (ret < 0)
 				return ret;
 			*val = ret;
 			return 0;
+		case hwmon_temp_max:
+			*val = READ_ONCE(data->temp_max);
+			return 0;
+		case hwmon_temp_crit:
+			*val = READ_ONCE(data->temp_crit);
+			return 0;
+		case hwmon_temp_max_alarm:
+			*val = READ_ONCE(data->max_alarm);
+			return 0;
+		case hwmon_temp_crit_alarm:
+			*val = READ_ONCE(data->crit_alarm);
+			return 0;
 		}
 		break;
 	case hwmon_pwm:
@@ -324,7 +1386,12 @@ static int ibg10_read(struct device *dev, enum hwmon_sensor_types type,
 			*val = (ret * 255) / FAN_SPEED_MAX;
 			return 0;
 		} else if (attr == hwmon_pwm_enable) {
-			*val = data->fans_initialized ? 1 : 2;
+			if (test_bit(channel, &data->curve_channels))
+				*val = IBG10_PWM_CURVE;
+			else if (data->ec_curve)
+				*val = IBG10_PWM_EC_CURVE;
+			else
+				*val = data->fans_initialized ? IBG10_PWM_MANUAL : IBG10_PWM_AUTO;
 			return 0;
 		}
 		break;
@@ -357,20 +1424,33 @@ static int ibg10_write(struct device *dev, enum hwmon_sensor_types type,
 {
 	struct ibg10_data *data = dev_get_drvdata(dev);
 	u8 speed;
+	int ret;
 
 	switch (type) {
+	case hwmon_temp:
+		val = clamp_val(val, 0, IBG10_CURVE_TEMP_MAX);
+		if (attr == hwmon_temp_max) {
+			WRITE_ONCE(data->temp_max, val);
+			return 0;
+		} else if (attr == hwmon_temp_crit) {
+			WRITE_ONCE(data->temp_crit, val);
+			return 0;
+		}
+		break;
 	case hwmon_pwm:
 		if (attr == hwmon_pwm_input) {
 			if (val < 0 || val > 255)
 				return -EINVAL;
 			speed = (val * FAN_SPEED_MAX) / 255;
-			return fan_set_speed(data, channel, speed);
+			mutex_lock(&data->fan_lock);
+			ret = fan_write_speeds(data, BIT(channel), speed);
+			mutex_unlock(&data->fan_lock);
+			return ret;
 		} else if (attr == hwmon_pwm_enable) {
-			if (val == 2)
-				return fan_set_auto(data);
-			else if (val == 1)
-				return init_custom_fan_table(data);
-			return -EINVAL;
+			mutex_lock(&data->fan_lock);
+			ret = fan_set_mode(data, channel, val);
+			mutex_unlock(&data->fan_lock);
+			return ret;
 		}
 		break;
 	default:
@@ -380,6 +1460,159 @@ static int ibg10_write(struct device *dev, enum hwmon_sensor_types type,
 	return -EOPNOTSUPP;
 }
 
+/* Set both fans at once, as the daemon does for the shared heatpipes */
+static ssize_t pwm_all_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct ibg10_data *data = dev_get_drvdata(dev);
+	long val;
+	u8 speed;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	speed = (val * FAN_SPEED_MAX) / 255;
+	mutex_lock(&data->fan_lock);
+	ret = fan_write_speeds(data, BIT(0) | BIT(1), speed);
+	mutex_unlock(&data->fan_lock);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_WO(pwm_all);
+
+/* Writing anything drops the register shadow, e.g. after the EC took over */
+static ssize_t shadow_invalidate_store(struct device *dev, struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct ibg10_data *data = dev_get_drvdata(dev);
+
+	uw_shadow_invalidate(data);
+	return count;
+}
+
+static DEVICE_ATTR_WO(shadow_invalidate);
+
+/* pwmN_auto_pointM_{pwm,temp}: nr = channel, index = point */
+static ssize_t auto_point_pwm_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ibg10_data *data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%ld\n", READ_ONCE(data->curve[sattr->nr].pwm[sattr->index]));
+}
+
+static ssize_t auto_point_pwm_store(struct device *dev, struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ibg10_data *data = dev_get_drvdata(dev);
+	struct ibg10_curve *curve = &data->curve[sattr->nr];
+	int pt = sattr->index;
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	/* The curve must never fall with rising temperature */
+	mutex_lock(&data->fan_lock);
+	if ((pt > 0 && val < curve->pwm[pt - 1]) ||
+	    (pt < IBG10_CURVE_POINTS - 1 && val > curve->pwm[pt + 1]))
+		ret = -EINVAL;
+	else
+		WRITE_ONCE(curve->pwm[pt], val);
+	if (!ret && data->ec_curve)
+		fan_set_ec_curve(data);
+	mutex_unlock(&data->fan_lock);
+
+	return ret ? ret : count;
+}
+
+static ssize_t auto_point_temp_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ibg10_data *data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%ld\n", READ_ONCE(data->curve[sattr->nr].temp[sattr->index]));
+}
+
+static ssize_t auto_point_temp_store(struct device *dev, struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ibg10_data *data = dev_get_drvdata(dev);
+	struct ibg10_curve *curve = &data->curve[sattr->nr];
+	int pt = sattr->index;
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val < 0 || val > IBG10_CURVE_TEMP_MAX)
+		return -EINVAL;
+
+	/* Points must stay in strictly ascending temperature order */
+	mutex_lock(&data->fan_lock);
+	if ((pt > 0 && val <= curve->temp[pt - 1]) ||
+	    (pt < IBG10_CURVE_POINTS - 1 && val >= curve->temp[pt + 1]))
+		ret = -EINVAL;
+	else
+		WRITE_ONCE(curve->temp[pt], val);
+	if (!ret && data->ec_curve)
+		fan_set_ec_curve(data);
+	mutex_unlock(&data->fan_lock);
+
+	return ret ? ret : count;
+}
+
+#define IBG10_AUTO_POINT(ch, pt)							\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_point##pt##_pwm, auto_point_pwm,	\
+				       (ch) - 1, (pt) - 1);				\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_point##pt##_temp, auto_point_temp,	\
+				       (ch) - 1, (pt) - 1)
+
+#define IBG10_AUTO_POINT_ATTRS(ch, pt)					\
+	&sensor_dev_attr_pwm##ch##_auto_point##pt##_pwm.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##ch##_auto_point##pt##_temp.dev_attr.attr
+
+IBG10_AUTO_POINT(1, 1);
+IBG10_AUTO_POINT(1, 2);
+IBG10_AUTO_POINT(1, 3);
+IBG10_AUTO_POINT(1, 4);
+IBG10_AUTO_POINT(1, 5);
+IBG10_AUTO_POINT(2, 1);
+IBG10_AUTO_POINT(2, 2);
+IBG10_AUTO_POINT(2, 3);
+IBG10_AUTO_POINT(2, 4);
+IBG10_AUTO_POINT(2, 5);
+
+static struct attribute *ibg10_attrs[] = {
+	&dev_attr_pwm_all.attr,
+	&dev_attr_shadow_invalidate.attr,
+	IBG10_AUTO_POINT_ATTRS(1, 1),
+	IBG10_AUTO_POINT_ATTRS(1, 2),
+	IBG10_AUTO_POINT_ATTRS(1, 3),
+	IBG10_AUTO_POINT_ATTRS(1, 4),
+	IBG10_AUTO_POINT_ATTRS(1, 5),
+	IBG10_AUTO_POINT_ATTRS(2, 1),
+	IBG10_AUTO_POINT_ATTRS(2, 2),
+	IBG10_AUTO_POINT_ATTRS(2, 3),
+	IBG10_AUTO_POINT_ATTRS(2, 4),
+	IBG10_AUTO_POINT_ATTRS(2, 5),
+	NULL
+};
+
+ATTRIBUTE_GROUPS(ibg10);
+
 static const struct hwmon_ops ibg10_hwmon_ops = {
 	.is_visible = ibg10_is_visible,
 	.read = ibg10_read,
@@ -389,7 +1622,9 @@ static const struct hwmon_ops ibg10_hwmon_ops = {
 
 static const struct hwmon_channel_info *const ibg10_info[] = {
 	HWMON_CHANNEL_INFO(chip, HWMON_C_REGISTER_TZ),
-	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX | HWMON_T_CRIT |
+			   HWMON_T_MAX_ALARM | HWMON_T_CRIT_ALARM),
 	HWMON_CHANNEL_INFO(pwm,
 			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
 			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
@@ -401,8 +1636,164 @@ static const struct hwmon_chip_info ibg10_chip_info = {
 	.info = ibg10_info,
 };
 
+static int write_attempts_show(struct seq_file *s, void *unused)
+{
+	struct ibg10_data *data = s->private;
+	int i;
+
+	for (i = 0; i < UW_WRITE_MAX_ATTEMPTS; i++)
+		seq_printf(s, "%2d: %d\n", i + 1, atomic_read(&data->write_attempts[i]));
+	seq_printf(s, "unverified: %d\n", atomic_read(&data->write_unverified));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(write_attempts);
+
+static int ec_stats_show(struct seq_file *s, void *unused)
+{
+	struct ibg10_data *data = s->private;
+	struct uw_ec_stats *st = &data->ec_stats;
+	int i;
+
+	/* Not counted as a lock user, this only looks */
+	mutex_lock(&data->ec_lock);
+	seq_printf(s, "read_failures: %u\n", st->read_failures);
+	seq_printf(s, "write_retries: %u\n", st->write_retries);
+	seq_printf(s, "write_failures: %u\n", st->write_failures);
+	seq_printf(s, "wmi_calls: %llu\n", st->wmi_calls);
+	seq_printf(s, "wmi_total_us: %llu\n", div_u64(st->wmi_ns, NSEC_PER_USEC));
+	seq_printf(s, "wmi_max_us: %llu\n", div_u64(st->wmi_max_ns, NSEC_PER_USEC));
+	seq_printf(s, "lock_acquired: %llu\n", st->lock_acquired);
+	seq_printf(s, "lock_contended: %llu\n", st->lock_contended);
+	seq_printf(s, "lock_wait_us: %llu\n", div_u64(st->lock_wait_ns, NSEC_PER_USEC));
+	seq_printf(s, "lock_held_us: %llu\n", div_u64(st->lock_held_ns, NSEC_PER_USEC));
+	seq_puts(s, "wmi_latency_us:\n");
+	for (i = 0; i < UW_WMI_HIST_BUCKETS; i++) {
+		if (i < UW_WMI_HIST_BUCKETS - 1)
+			seq_printf(s, "  <%7lu: %u\n", BIT(i), st->wmi_hist[i]);
+		else
+			seq_printf(s, "  >=%6lu: %u\n", BIT(i - 1), st->wmi_hist[i]);
+	}
+	mutex_unlock(&data->ec_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ec_stats);
+
+static int ec_registers_show(struct seq_file *s, void *unused)
+{
+	struct ibg10_data *data = s->private;
+	struct uw_ec_stats *st = &data->ec_stats;
+	int i;
+
+	mutex_lock(&data->ec_lock);
+	seq_puts(s, "addr    reads   writes\n");
+	for (i = 0; i <= UW_SHADOW_SIZE; i++) {
+		if (!st->reads[i] && !st->writes[i])
+			continue;
+		if (i == UW_SHADOW_SIZE)
+			seq_puts(s, "other ");
+		else
+			seq_printf(s, "0x%04x", uw_shadow_addr(i));
+		seq_printf(s, " %8u %8u\n", st->reads[i], st->writes[i]);
+	}
+	mutex_unlock(&data->ec_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ec_registers);
+
+#define UW_EC_DUMP_CHUNK       UW_EC_FAN_TABLE_LEN
+
+/*
+ * Raw EC contents, the file offset being the register address. Each read
+ * returns up to UW_EC_DUMP_CHUNK registers from one batch, stopping short
+ * before the first register that could not be read.
+ */
+static ssize_t ec_dump_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct ibg10_data *data = file->private_data;
+	struct uw_ec_op ops[UW_EC_DUMP_CHUNK];
+	u8 bytes[UW_EC_DUMP_CHUNK];
+	loff_t pos = *ppos;
+	size_t i, n;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= UW_EC_ADDR_SPACE || !count)
+		return 0;
+
+	n = min_t(size_t, count, UW_EC_DUMP_CHUNK);
+	n = min_t(size_t, n, UW_EC_ADDR_SPACE - pos);
+	for (i = 0; i < n; i++)
+		ops[i] = UW_EC_OP(READ, pos + i, 0);
+	uw_ec_batch(data, ops, n);
+
+	for (i = 0; i < n && !(ops[i].type & UW_EC_OP_FAILED); i++)
+		bytes[i] = ops[i].value;
+	if (!i)
+		return -EIO;
+	if (copy_to_user(buf, bytes, i))
+		return -EFAULT;
+
+	*ppos = pos + i;
+	return i;
+}
+
+static const struct file_operations ec_dump_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = ec_dump_read,
+	.llseek = default_llseek,
+};
+
+static void ibg10_debugfs_init(struct ibg10_data *data)
+{
+	data->debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("write_attempts", 0444, data->debugfs, data, &write_attempts_fops);
+	debugfs_create_file("ec_stats", 0444, data->debugfs, data, &ec_stats_fops);
+	debugfs_create_file("ec_registers", 0444, data->debugfs, data, &ec_registers_fops);
+	debugfs_create_file_size("ec_dump", 0400, data->debugfs, data, &ec_dump_fops,
+				 UW_EC_ADDR_SPACE);
+}
+
 static struct ibg10_data *gdata;
 
+static int ibg10_resume(struct device *dev)
+{
+	struct ibg10_data *data = dev_get_drvdata(dev);
+
+	queue_work(system_freezable_wq, &data->resume_work);
+	return 0;
+}
+
+static DEFINE_SIMPLE_DEV_PM_OPS(ibg10_pm_ops, NULL, ibg10_resume);
+
+static int __init ibg10_probe(struct platform_device *pdev)
+{
+	struct device *hwmon_dev;
+
+	platform_set_drvdata(pdev, gdata);
+
+	hwmon_dev = devm_hwmon_device_register_with_info(&pdev->dev, "uniwill_ibg10_fanctl", gdata,
+							 &ibg10_chip_info, ibg10_groups);
+	if (IS_ERR(hwmon_dev))
+		return PTR_ERR(hwmon_dev);
+
+	gdata->hwmon_dev = hwmon_dev;
+	return 0;
+}
+
+static struct platform_driver ibg10_driver = {
+	.driver = {
+		.name = "tuxedo_ibg10_fan",
+		.pm = pm_sleep_ptr(&ibg10_pm_ops),
+	},
+};
+
 static int __init ibg10_fan_init(void)
 {
 	int ret;
@@ -416,9 +1807,23 @@ static int __init ibg10_fan_init(void)
 	if (!gdata)
 		return -ENOMEM;
 
+	mutex_init(&gdata->fan_lock);
 	mutex_init(&gdata->ec_lock);
-
-	gdata->pdev = platform_device_register_simple("tuxedo_ibg10_fan", -1, NULL, 0);
+	spin_lock_init(&gdata->shadow_lock);
+	spin_lock_init(&gdata->pending_lock);
+	INIT_WORK(&gdata->pwm_work, ibg10_pwm_work);
+	INIT_WORK(&gdata->init_work, ibg10_init_work);
+	INIT_WORK(&gdata->resume_work, ibg10_resume_work);
+	INIT_DELAYED_WORK(&gdata->curve_work, ibg10_curve_work);
+	INIT_DELAYED_WORK(&gdata->temp_work, ibg10_temp_work);
+	gdata->curve[0] = ibg10_default_curve;
+	gdata->curve[1] = ibg10_default_curve;
+	gdata->temp_max = IBG10_TEMP_MAX_DEFAULT;
+	gdata->temp_crit = IBG10_TEMP_CRIT_DEFAULT;
+	gdata->temp_read_stamp = jiffies - msecs_to_jiffies(IBG10_TEMP_IDLE_MS);
+
+	/* A driver rather than a bare device, for the PM callbacks */
+	gdata->pdev = platform_create_bundle(&ibg10_driver, ibg10_probe, NULL, 0, NULL, 0);
 	if (IS_ERR(gdata->pdev)) {
 		ret = PTR_ERR(gdata->pdev);
 		kfree(gdata);
@@ -426,19 +1831,11 @@ static int __init ibg10_fan_init(void)
 		return ret;
 	}
 
-	platform_set_drvdata(gdata->pdev, gdata);
-
-	gdata->hwmon_dev = devm_hwmon_device_register_with_info(&gdata->pdev->dev,
-			     "uniwill_ibg10_fanctl", gdata,
-			     &ibg10_chip_info, NULL);
+	ibg10_debugfs_init(gdata);
 
-	if (IS_ERR(gdata->hwmon_dev)) {
-		ret = PTR_ERR(gdata->hwmon_dev);
-		platform_device_unregister(gdata->pdev);
-		kfree(gdata);
-		gdata = NULL;
-		return ret;
-	}
+	/* Have the fan table ready before the daemon's first pwm write */
+	if (init_on_load)
+		schedule_work(&gdata->init_work);
 
 	pr_info("Registered hwmon device 'uniwill_ibg10_fanctl'\n");
 	return 0;
@@ -449,8 +1846,25 @@ static void __exit ibg10_fan_exit(void)
 	if (!gdata)
 		return;
 
-	fan_set_auto(gdata);
+	/*
+	 * temp_work and resume_work notify the hwmon device, stop them before
+	 * that goes away. Anything still running may try to start temp_work
+	 * again, exiting keeps it from being queued or doing anything.
+	 */
+	WRITE_ONCE(gdata->exiting, true);
+	cancel_delayed_work_sync(&gdata->temp_work);
+	cancel_work_sync(&gdata->resume_work);
+	debugfs_remove_recursive(gdata->debugfs);
 	platform_device_unregister(gdata->pdev);
+	platform_driver_unregister(&ibg10_driver);
+
+	/* The hwmon device is gone, so no new work can be queued */
+	cancel_delayed_work_sync(&gdata->curve_work);
+	cancel_work_sync(&gdata->init_work);
+	cancel_work_sync(&gdata->pwm_work);
+	/* Work cancelled above may have queued it once more before seeing exiting */
+	cancel_delayed_work_sync(&gdata->temp_work);
+	fan_set_auto(gdata);
 	kfree(gdata);
 	gdata = NULL;
 }
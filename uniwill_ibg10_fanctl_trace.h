@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for EC traffic of uniwill_ibg10_fanctl, to line fan control
+ * up with other activity in perf/trace-cmd timelines.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uniwill_ibg10_fanctl
+
+#if !defined(_UNIWILL_IBG10_FANCTL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UNIWILL_IBG10_FANCTL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(uw_ec_access,
+	TP_PROTO(u16 addr, u8 value, int retries, int ret, u64 duration_ns),
+	TP_ARGS(addr, value, retries, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(u16, addr)
+		__field(u8, value)
+		__field(int, retries)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->value = value;
+		__entry->retries = retries;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("addr=0x%04x value=0x%02x retries=%d ret=%d duration_ns=%llu",
+		  __entry->addr, __entry->value, __entry->retries, __entry->ret,
+		  __entry->duration_ns)
+);
+
+/* One WMI register read, value is 0 if it failed */
+DEFINE_EVENT(uw_ec_access, uw_ec_read,
+	TP_PROTO(u16 addr, u8 value, int retries, int ret, u64 duration_ns),
+	TP_ARGS(addr, value, retries, ret, duration_ns)
+);
+
+/* One WMI register write, including its retries */
+DEFINE_EVENT(uw_ec_access, uw_ec_write,
+	TP_PROTO(u16 addr, u8 value, int retries, int ret, u64 duration_ns),
+	TP_ARGS(addr, value, retries, ret, duration_ns)
+);
+
+/* A fan speed write for the fans in mask, unverified ones never read back right */
+TRACE_EVENT(fan_set_speed,
+	TP_PROTO(unsigned long mask, u8 speed, unsigned int attempts,
+		 unsigned long unverified, int ret, u64 duration_ns),
+	TP_ARGS(mask, speed, attempts, unverified, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, mask)
+		__field(u8, speed)
+		__field(unsigned int, attempts)
+		__field(unsigned long, unverified)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->mask = mask;
+		__entry->speed = speed;
+		__entry->attempts = attempts;
+		__entry->unverified = unverified;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("fans=0x%lx speed=%u attempts=%u unverified=0x%lx ret=%d duration_ns=%llu",
+		  __entry->mask, __entry->speed, __entry->attempts, __entry->unverified,
+		  __entry->ret, __entry->duration_ns)
+);
+
+DECLARE_EVENT_CLASS(fan_mode_change,
+	TP_PROTO(int ret, u64 duration_ns),
+	TP_ARGS(ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("ret=%d duration_ns=%llu", __entry->ret, __entry->duration_ns)
+);
+
+/* Switching the EC to the custom fan table for manual control */
+DEFINE_EVENT(fan_mode_change, init_custom_fan_table,
+	TP_PROTO(int ret, u64 duration_ns),
+	TP_ARGS(ret, duration_ns)
+);
+
+/* Handing the fans back to the EC firmware */
+DEFINE_EVENT(fan_mode_change, fan_set_auto,
+	TP_PROTO(int ret, u64 duration_ns),
+	TP_ARGS(ret, duration_ns)
+);
+
+#endif /* _UNIWILL_IBG10_FANCTL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE uniwill_ibg10_fanctl_trace
+#include <trace/define_trace.h>